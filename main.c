@@ -21,6 +21,7 @@ GNU General Public License for more details.
 ******************************************************************
 */
 
+#define _GNU_SOURCE /* for sendmmsg() */
 #include <sys/socket.h>
 #include <netinet/ip.h>
 #include <netinet/udp.h>
@@ -34,8 +35,94 @@ GNU General Public License for more details.
 #include <unistd.h>
 #include <stdarg.h>
 #include <syslog.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <signal.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <linux/pkt_cls.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+/* The AF_XDP and tc fast paths are optional, and whether the kernel supports
+   them is only known at run time; so that the relay still builds with kernel
+   headers as old as 4.18, the newer constants they use are spelled out here.
+   These are enum values in the headers, which cannot be tested for */
+#define LINK_CREATE_CMD 28    /* BPF_LINK_CREATE (5.7) */
+#define XDP_ATTACH_TYPE 37    /* BPF_XDP (5.9) */
+#define TCX_INGRESS 46        /* BPF_TCX_INGRESS (6.6) */
+#define FUNC_CHECK_MTU 163    /* BPF_FUNC_check_mtu (5.12) */
+#ifndef BPF_ATOMIC
+#define BPF_ATOMIC 0xc0       /* BPF_XADD before 5.12 */
+#endif
+#ifndef XDP_COPY
+#define XDP_COPY (1 << 1)     /* 4.20 */
+#endif
+#ifndef XDP_ZEROCOPY
+#define XDP_ZEROCOPY (1 << 2)
+#endif
+
+/* The BPF_LINK_CREATE attributes, which union bpf_attr lacks before 5.7 */
+struct BpfLinkCreate {
+    uint32_t prog_fd;
+    uint32_t target_ifindex;
+    uint32_t attach_type;
+    uint32_t flags;
+};
+
+/* USDT probes (provider "ubrr") on the forwarding path, for bpftrace, perf or
+   SystemTap; each is a nop until a tracer attaches to it. They need
+   <sys/sdt.h> (e.g. from systemtap-sdt-dev) at build time, and compile to
+   nothing without it. The arguments are listed in the README, and addresses
+   are in network order */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define USDT(name, ...) STAP_PROBEV(ubrr, name, __VA_ARGS__)
+#endif
+#endif
+#ifndef USDT
+#define USDT(name, ...) do { } while (0)
+#endif
+
+/* The reason argument of the ubrr:drop probe */
+enum {
+    USDT_DROP_IFACE = 1,      /* received on another interface */
+    USDT_DROP_ECHO_TTL,
+    USDT_DROP_ECHO_SADDR,
+    USDT_DROP_TRUNCATED,
+    USDT_DROP_QUEUE_FULL,
+    USDT_DROP_TOO_BIG,
+    USDT_DROP_HEAD,           /* queued, dropped to make room (--queue-drop) */
+    USDT_DROP_NO_SLOT,        /* no free queue slot to copy the datagram to */
+    USDT_DROP_NO_CMSG         /* received without the ancillary data */
+};
 
 #define MAXIFS 2
+#define TRUNK_MAX_VLANS 32
 #define IF_LEFT 0
 #define IF_RIGHT 1
 
@@ -53,6 +140,88 @@ GNU General Public License for more details.
     fprintf(stderr, __VA_ARGS__); \
     }
 
+#define IPRINT(...) if (forked_) { \
+    syslog(LOG_INFO, __VA_ARGS__); \
+    } else { \
+    printf(__VA_ARGS__); \
+    }
+
+/* The IP and UDP headers of a datagram being transmitted */
+struct PktHdr {
+    struct iphdr ip;
+    struct udphdr udp;
+};
+
+/* Egress scheduling. Datagrams to be transmitted are queued per egress
+   interface and per traffic class (0 is the highest priority, and traffic not
+   matched by any --class rule goes into the lowest). The queues are bounded,
+   and served either in strict priority order or by deficit round robin. */
+#define SCHED_CLASSES 4
+#define SCHED_DEFAULT_DEPTH 64
+#define SCHED_MAX_DEPTH 4096
+#define SCHED_MAX_RULES 16
+#define SCHED_QUANTUM 1500    /* bytes per unit of DRR weight */
+#define SCHED_TX_BATCH 64     /* packets per sendmmsg(), and most fragments
+                                 per datagram */
+#define SCHED_RX_BURST 32     /* datagrams received between transmissions */
+#define SCHED_RETRY_MS 1      /* wait when an interface pushes back */
+
+/* Packet buffers. They are carved out of one arena, allocated at startup from
+   2 MB huge pages if the system has some reserved (and from normal pages,
+   with transparent huge pages advised, otherwise), on the NUMA node of the
+   CPU the relay starts on, so that nothing on the forwarding path calls
+   malloc(). A pool has cache line aligned slots of one size, each with a
+   reference count: a receive buffer stays in use as long as
+   any datagram queued from it (GRO segments, fragments) has not been sent.
+   Each forwarding thread has its own pools, whose free lists therefore need
+   no locking; the relay has a single one. */
+#define POOL_ALIGN 64             /* cache line */
+#define POOL_HUGEPAGE (2ul << 20)
+#define POOL_RX_BUFS (2 * SCHED_RX_BURST) /* a burst, and the one in progress */
+#define POOL_ALIGN_UP(len, align) (((len) + (align) - 1) & ~((size_t) (align) - 1))
+#define POOL_MAX_NODES 1024       /* NUMA nodes the arena can be bound to */
+
+struct PktPool {
+    unsigned char *slots;
+    size_t slot_len;
+    unsigned int nslots;
+    unsigned int *free;       /* stack of the indices of the free slots */
+    unsigned int nfree;
+    unsigned int *refs;
+    unsigned long exhausted;  /* times no slot was free */
+};
+
+/* The pools of one forwarding thread */
+struct PktPools {
+    struct PktPool rx;        /* receive buffers, of the largest datagram */
+    struct PktPool tx;        /* egress queue slots, of the largest packet,
+                                 for copies when the receive buffers run out */
+    void *arena;
+    size_t arena_len;
+    int hugepages;
+    int node;                 /* NUMA node of the arena, or -1 */
+};
+
+struct QueuedPkt {
+    struct PktHdr hdr;        /* just the IP header on fragments but the first */
+    size_t hdr_len;
+    unsigned char *payload;   /* in slot `slot` of `pool` */
+    struct PktPool *pool;
+    unsigned int slot;
+    size_t len;
+    size_t cost;              /* DRR cost: the bytes of the whole datagram on
+                                 its first packet, 0 on the other fragments */
+};
+
+struct TxQueue {
+    struct QueuedPkt *pkts;   /* ring of `depth` entries */
+    unsigned int depth;
+    unsigned int head;
+    unsigned int count;
+    unsigned long deficit;    /* DRR */
+    unsigned long queued, sent, dropped, errors;
+};
+
 /* list of addresses and interface numbers on local machine */
 struct Iface {
     enum {
@@ -72,8 +241,19 @@ struct Iface {
     struct in_addr srcaddr; /* if srcaddrtype == SRCA_SPECIFIED */
     unsigned int ifindex;
     int raw_socket;
+    unsigned short vlan_id; /* trunk mode only */
+    struct TxQueue queues[SCHED_CLASSES];
+    unsigned int queued;      /* total over all classes */
+    unsigned int drr_class;   /* class the DRR scheduler is serving */
+    int drr_fresh;            /* drr_class has not had its quantum yet */
+    int mtu;
+    unsigned long fragmented; /* datagrams sent as IP fragments */
+    unsigned long truncated;  /* datagrams received truncated (not relayed) */
+    unsigned long too_big;    /* datagrams too large to relay even fragmented */
+    unsigned long xsk_received, xsk_forwarded, xsk_dropped; /* AF_XDP */
 };
-static struct Iface ifs_[MAXIFS] = {0};
+static struct Iface ifs_[TRUNK_MAX_VLANS] = {0};
+static unsigned int nifs_ = MAXIFS; /* in use in ifs_[]; more in trunk mode */
 
 #define IFS_LEFT 0
 #define IFS_RIGHT 1
@@ -84,11 +264,256 @@ static int forked_ = 0;
 static unsigned short udport_ = 0;
 static int largest_mtu_ = 0;
 static unsigned char echo_marker_ttl_ = 0;
+static char const *handover_path_ = 0;
+
+/* UDP GRO. When the kernel supports it, bursts of same-size datagrams from one
+   sender are received as a single coalesced buffer, which is split up again
+   before being forwarded. */
+#define UDP_RCV_BUF_LEN 65536 /* the largest datagram, or GRO-coalesced train */
+static int udp_gro_ = 0;
+
+struct ClassRule {
+    enum {
+        MATCH_SPORT,
+        MATCH_DSCP
+    } match;
+    unsigned int value;
+    unsigned int cls;
+};
+static struct ClassRule class_rules_[SCHED_MAX_RULES];
+static unsigned int nclass_rules_ = 0;
+static enum {
+    SCHED_STRICT = 0,
+    SCHED_DRR
+} sched_ = SCHED_STRICT;
+static int sched_set_ = 0;
+static unsigned int sched_weights_[SCHED_CLASSES] = {8, 4, 2, 1};
+static unsigned int queue_depth_ = 0; /* of the classes not in queue_depths_ */
+static unsigned int queue_depths_[SCHED_CLASSES] = {0};
+static int queue_depth_set_ = 0;
+static int queue_drop_head_ = -1;
+static size_t queue_slot_len_ = 0;
+static unsigned long sched_queued_ = 0; /* total over all interfaces */
+static struct PktPools pools_ = {0};
+static unsigned short frag_id_ = 0; /* IP ID of the last fragmented datagram */
+
+/* The TOS set on relayed packets, or TOS_PRESERVE to keep the received one */
+#define TOS_PRESERVE -1
+static int tos_ = 0;
+static int tos_set_ = 0;
+/* --tos-map: the DSCP set on relayed packets, by received DSCP, for those
+   with bit <DSCP> set in tos_mapped_ */
+static unsigned char tos_map_[64];
+static uint64_t tos_mapped_ = 0;
+
+static volatile sig_atomic_t dump_stats_ = 0;
+
+/* VLAN trunk mode. Instead of a UDP socket and a raw socket per interface, a
+   single AF_PACKET socket on the trunk (parent) interface receives the tagged
+   frames of all the VLANs, and frames are relayed by rewriting the 802.1Q tag
+   and the IP/UDP headers in place. `ifs_[]` then describe VLANs rather than
+   interfaces: the left and the right one, or the `nifs_` given with
+   --trunk-vlan, in which case a frame received on one VLAN is relayed to all
+   the others. */
+#define VLAN_HLEN 4
+#define VLAN_VID_MASK 0x0fff
+static char const *trunk_if_name_ = 0;
+static unsigned int trunk_ifindex_ = 0;
+static unsigned char trunk_mac_[ETH_ALEN];
+
+/* Packet capture. Relayed packets (as received, and as transmitted) are
+   appended to a fixed-size, memory-mapped pcapng file that is used as a ring,
+   so capturing costs no system calls. The ring always holds a valid sequence
+   of blocks: whatever is left of overwritten blocks is covered by a padding
+   block, which pcapng readers skip. */
+#define CAPTURE_DEFAULT_MB 16
+#define CAPTURE_MAX_MB 4096
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_PAD 0x80756272     /* local use block type, see the pcapng spec */
+#define PCAPNG_MIN_BLOCK 12       /* type, length, trailing length */
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_OPT_IF_NAME 2
+#define PCAPNG_OPT_EPB_FLAGS 2
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_ALIGN(len) (((len) + 3) & ~(size_t) 3)
+#define LINKTYPE_IPV4 228
+#define CAPTURE_SNAPLEN 65535
+#define CAPTURE_IN 1              /* epb_flags direction */
+#define CAPTURE_OUT 2
+
+static char const *capture_path_ = 0;
+static unsigned long capture_mb_ = 0;
+
+static struct {
+    unsigned char *map;
+    size_t ring_start;            /* offset of the ring, after the SHB and IDBs */
+    size_t ring_end;              /* size of the file */
+    size_t head;                  /* where the next block goes */
+    size_t next;                  /* start of the first block at or after head */
+} capture_ = {0};
+
+/* Socket handover. A running relay listens on the UNIX socket at
+   `handover_path_`. A newly started relay connects to it, receives the open
+   UDP and raw sockets via SCM_RIGHTS, and takes over the forwarding loop;
+   the old relay then exits. Because both processes share the same socket
+   (not just the same port), datagrams queued during the switch are not lost.
+   The new relay sends a 'K' before each lengthy setup step and an 'R' once it
+   is ready; the old relay answers 'D' once it has released the path, then
+   sends what it still has queued. */
+#define HANDOVER_MAGIC 0x75627272 /* "ubrr" */
+#define HANDOVER_VERSION 2
+#define HANDOVER_MAX_FDS 8
+#define HANDOVER_TIMEOUT_MS 5000
+#define HANDOVER_POLL_INTERVAL 1024 /* packets between checks when busy */
+
+enum {
+    HANDOVER_FD_UDP = 1,
+    HANDOVER_FD_RAW,
+    HANDOVER_FD_TRUNK,
+    HANDOVER_FD_MCAST
+};
+
+struct HandoverMsg {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int nfds;
+    struct {
+        int role;
+        unsigned int ifindex; /* if role is HANDOVER_FD_RAW or HANDOVER_FD_TRUNK */
+    } fds[HANDOVER_MAX_FDS];
+};
+
+/* Sockets received from the previous relay, or -1 */
+static int adopted_udp_socket_ = -1;
+static int adopted_raw_socket_[MAXIFS] = {-1, -1};
+static int adopted_trunk_socket_ = -1;
+
+/* Multicast groups relayed besides the broadcasts for --port, each received
+   on its own UDP socket, bound to the group address and port */
+#define MCAST_MAX_GROUPS (HANDOVER_MAX_FDS - 1 - MAXIFS) /* so that all the
+                                                            sockets can be
+                                                            handed over */
+struct McastGroup {
+    struct in_addr addr;
+    unsigned short port;
+    int socket;
+};
+static struct McastGroup mcast_groups_[MCAST_MAX_GROUPS];
+static unsigned int nmcast_groups_ = 0;
+
+/* AF_XDP mode. An XDP program on each interface redirects the frames for our
+   port to AF_XDP sockets (one per receive queue), which all share one UMEM: a
+   relayed frame is rewritten in place and put on a TX ring of the other
+   interface without being copied. What the program does not redirect goes up
+   the stack to the UDP socket, and is relayed as usual. */
+#define XSK_MAX_QUEUES 16
+#define XSK_FRAME_SIZE 4096
+#define XSK_NUM_FRAMES 4096
+#define XSK_RING_SIZE 1024
+#define XSK_BATCH 64          /* frames received per socket and pass */
+
+static enum {
+    XSK_MODE_OFF = 0,
+    XSK_MODE_AUTO,            /* native if the drivers support it, else SKB */
+    XSK_MODE_NATIVE,
+    XSK_MODE_SKB
+} xsk_mode_ = XSK_MODE_OFF;
+
+/* A ring shared with the kernel */
+struct XskRing {
+    uint32_t *producer;
+    uint32_t *consumer;
+    void *entries;
+    void *map;
+    size_t map_len;
+};
+
+struct Xsk {
+    int fd;
+    struct Iface *iface;
+    unsigned int queue;
+    struct XskRing rx, tx, fq, cq;
+    unsigned int tx_pending;  /* frames transmitted but not yet completed */
+};
+
+static struct {
+    unsigned char *umem;
+    uint64_t free_frames[XSK_NUM_FRAMES];
+    unsigned int nfree;
+    unsigned int fq_target;   /* frames to keep on each fill ring */
+    int waiting;              /* completions or frames for the fill rings are
+                                 due from the kernel */
+    struct Xsk socks[MAXIFS * XSK_MAX_QUEUES];
+    unsigned int nsocks;
+    unsigned int first_sock[MAXIFS];
+    unsigned int nqueues[MAXIFS];
+    unsigned char hwaddr[MAXIFS][ETH_ALEN];
+    int map_fd[MAXIFS];
+    int prog_fd[MAXIFS];
+    int link_fd[MAXIFS];
+} xsk_;
+
+/* In-kernel fast path (--tc). A BPF program on the tc ingress hook of each
+   interface relays the datagrams for our port itself: it does the echo check,
+   rewrites the headers as main() builds them, and clones the frame to the
+   other interface. The program is generic, and reads what to do from a map
+   that we fill from the configuration; what it cannot handle (fragments, IP
+   options, datagrams too large for the egress MTU) goes up the stack to the
+   UDP socket, and is relayed as usual. */
+struct TcConfig {             /* per receiving interface; addresses, and the
+                                 16-bit header words, in network order */
+    uint32_t tx_ifindex;
+    uint32_t echo_saddr;      /* echo if the source address is this; if 0,
+                                 echo if the TTL is echo_ttl */
+    uint32_t saddr;           /* 0 to keep the source address */
+    uint32_t daddr;
+    uint8_t dst_mac[ETH_ALEN];
+    uint16_t ttl_proto;       /* the IP TTL and protocol word */
+    uint8_t src_mac[ETH_ALEN];
+    uint8_t echo_ttl;
+    uint8_t pad;
+    uint8_t tos[256];         /* the TOS to set, by received TOS */
+};
+
+struct TcStats {              /* per receiving interface */
+    uint64_t forwarded;
+    uint64_t bytes;
+    uint64_t echoes;
+    uint64_t passed;          /* left to the UDP socket */
+    uint64_t errors;          /* failed to redirect, and dropped */
+};
+
+static int tc_mode_ = 0;
+static struct {
+    int config_fd;
+    int stats_fd;
+    int prog_fd[MAXIFS];
+    int link_fd[MAXIFS];
+} tc_;
 
 static void print_usage_and_exit(char const *progname) {
     char const *usage =
         "%s --port <udp port> --echo-marker <1-255> --left <interface> --right <interface> \n"
         "--left-src <arg> --left-dest <arg> --right-src <arg> --right-dest <arg>\n"
+        "[--handover <path>] [--capture <file> [--capture-size <MB>]]\n"
+        "[--class <sport|dscp>:<value>:<class> ...] [--sched strict|drr[:<weights>]]\n"
+        "[--queue-depth [<class>:]<n> ...] [--queue-drop tail|head]\n"
+        "[--tos preserve|<tos>]\n"
+        "[--tos-map <dscp>=<dscp> ...] [--mcast-group <group>:<port> ...]\n"
+        "[--xdp auto|native|skb | --tc]\n"
+        "[--debug] [--fork]\n"
+        "\n"
+        "%s --port <udp port> --echo-marker <1-255> --trunk <interface> \n"
+        "--left-vlan <vid> --right-vlan <vid>\n"
+        "--left-src <arg> --left-dest <arg> --right-src <arg> --right-dest <arg>\n"
+        "[--handover <path>] [--capture <file> [--capture-size <MB>]]\n"
+        "[--debug] [--fork]\n"
+        "\n"
+        "%s --port <udp port> --echo-marker <1-255> --trunk <interface> \n"
+        "--trunk-vlan <vid>:<src>:<dst> --trunk-vlan <vid>:<src>:<dst> ...\n"
+        "[--handover <path>] [--capture <file> [--capture-size <MB>]]\n"
         "[--debug] [--fork]\n"
         "\n"
         "This program forwards UDP packets addressed to a specific UDP port between\n"
@@ -101,6 +526,21 @@ static void print_usage_and_exit(char const *progname) {
 	"                   packets echoed back (1-255)\n"
         "--left <name>      the name of the left interface\n"
         "--right <name>     the name of the right interface\n"
+        "--trunk <name>     trunk mode: relay between VLANs tagged on the\n"
+        "                   interface <name>, using a single packet socket,\n"
+        "                   instead of between --left and --right. In this mode\n"
+        "                   the -src arguments cannot be \"ifaddr\" and the -dst\n"
+        "                   arguments must be specified as x.x.x.x\n"
+        "--left-vlan <vid>  trunk mode: the VLAN ID (1-4094) of the left VLAN\n"
+        "--right-vlan <vid> trunk mode: the VLAN ID (1-4094) of the right VLAN\n"
+        "--trunk-vlan <vid>:<src>:<dst>\n"
+        "                   trunk mode: relay between any number of VLANs instead\n"
+        "                   of between --left-vlan and --right-vlan, each datagram\n"
+        "                   received on one of them being relayed to all the\n"
+        "                   others. Datagrams relayed to VLAN <vid> (1-4094) get\n"
+        "                   the source address <src> (\"unchanged\" or x.x.x.x)\n"
+        "                   and the destination address <dst> (x.x.x.x). May be\n"
+        "                   repeated, up to 32 times\n"
         "--left-src <arg>   this affects the source address that is set on packets\n"
         "                   that arrive on right and are forwarded to left.\n"
         "                   <arg> must have one of the following values:\n"
@@ -118,9 +558,58 @@ static void print_usage_and_exit(char const *progname) {
         "                   right direction\n"
         " --right-dst <arg> Same as --left-dst, except this applies to the right to\n"
         "                   left direction\n"
+        "--handover <path>  UNIX socket path used to hand the open sockets over to\n"
+        "                   a newly started relay (for restarts and upgrades\n"
+        "                   without packet loss). If a relay is already listening\n"
+        "                   on <path>, take over from it; then listen on <path>\n"
+        "                   for our own successor\n"
+        "--capture <file>   record every relayed packet, as received and as sent,\n"
+        "                   with the forwarding decision, in <file> (pcapng). The\n"
+        "                   file has a fixed size and wraps around, keeping the\n"
+        "                   most recent packets\n"
+        "--capture-size <MB> the size of the capture file (default 16)\n"
+        "--class <rule>     assign datagrams to a traffic class (0-3, 0 being the\n"
+        "                   highest priority) for egress scheduling. <rule> is\n"
+        "                   sport:<udp source port>:<class> or\n"
+        "                   dscp:<dscp value>:<class>. May be repeated; the first\n"
+        "                   matching rule applies, and datagrams not matched by\n"
+        "                   any rule are in class 3\n"
+        "--sched <arg>      how the class queues of each interface are served:\n"
+        "                   \"strict\" (the default) for strict priority, or\n"
+        "                   \"drr\" for deficit round robin, optionally followed by\n"
+        "                   the weights of the classes (default drr:8,4,2,1)\n"
+        "--queue-depth <arg> the number of datagrams each class queue can hold\n"
+        "                   (default 64), or with <class>:<n>, the queue of class\n"
+        "                   <class> only. May be repeated\n"
+        "--queue-drop <arg> what to drop when a queue is full: \"tail\" (the\n"
+        "                   arriving datagram, the default) or \"head\" (the\n"
+        "                   oldest queued datagram)\n"
+        "--tos <arg>        the TOS byte set on relayed packets: \"preserve\" to\n"
+        "                   keep the received one, or a value (default 0)\n"
+        "--tos-map <from>=<to>\n"
+        "                   set DSCP <to> on relayed packets received with DSCP\n"
+        "                   <from>, in place of the one --tos gives. May be\n"
+        "                   repeated\n"
+        "                   Scheduling options are not available in trunk mode.\n"
+        "                   Send SIGUSR1 to log the queue statistics.\n"
+        "--mcast-group <group>:<port>\n"
+        "                   also relay the datagrams sent to the multicast group\n"
+        "                   <group> and UDP port <port> (e.g. 239.255.255.250:1900\n"
+        "                   for SSDP, or 224.0.0.251:5353 for mDNS), to the same\n"
+        "                   group. May be repeated, up to 5 times. The -src\n"
+        "                   arguments apply, but not the -dst ones\n"
+        "--xdp <mode>       receive and send the packets for our port through\n"
+        "                   AF_XDP sockets, bypassing the network stack. <mode>\n"
+        "                   is \"native\" (in the driver), \"skb\" (generic XDP,\n"
+        "                   for any interface) or \"auto\" (native, falling back\n"
+        "                   to skb). Not available with --trunk or --handover\n"
+        "--tc               relay the packets for our port in the kernel, with a\n"
+        "                   BPF program on the tc ingress hook of each interface\n"
+        "                   (needs Linux 6.6 or later). Not available with\n"
+        "                   --trunk or --xdp\n"
         "--debug            enable debug logs on stdout\n"
         "--fork             run in the background\n";
-    printf(usage, progname);
+    printf(usage, progname, progname, progname);
     exit(1);
 }
 
@@ -167,6 +656,54 @@ static unsigned short udp_csum(struct iphdr *ip, struct udphdr *udp,
   return ~sum;
 }
 
+/* Utility function to compute the IPv4 header checksum */
+static unsigned short ip_csum(struct iphdr *ip) {
+    unsigned short *sptr = (unsigned short *) ip;
+    unsigned long sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < ip->ihl * 2u; i++) {
+        sum += ntohs(sptr[i]);
+    }
+
+    /* Fold the carry until there is no carry */
+    while ((sum >> 16) != 0) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return ~sum;
+}
+
+/* The TOS of a relayed packet, from --tos and --tos-map */
+static unsigned char relay_tos(unsigned char rcv_tos) {
+    unsigned char tos = (tos_ == TOS_PRESERVE) ? rcv_tos : (unsigned char) tos_;
+
+    if (tos_mapped_ & (1ull << (rcv_tos >> 2))) {
+        tos = (unsigned char) ((tos_map_[rcv_tos >> 2] << 2) | (tos & 3));
+    }
+    return tos;
+}
+
+/*
+ * Rewrite, in place, the IP and UDP headers of a received datagram that is
+ * relayed to `txiface` (as main() builds them), and recompute the checksums.
+ */
+static void rewrite_headers(struct iphdr *ip, struct udphdr *udp,
+                            struct Iface const *txiface) {
+    ip->tos = relay_tos(ip->tos);
+    ip->ttl = (echo_marker_ttl_ == 0) ? 64 : (unsigned char) echo_marker_ttl_;
+    if (txiface->srcaddrtype != SRCA_UNCHANGED) {
+        ip->saddr = txiface->srcaddr.s_addr;
+    }
+    ip->daddr = txiface->dstaddr.s_addr;
+    ip->check = 0;
+    ip->check = htons(ip_csum(ip));
+
+    udp->check = 0;
+    udp->check = htons(udp_csum(ip, udp, (unsigned char *) (udp + 1),
+                                ntohs(udp->len) - sizeof(*udp)));
+}
+
 /* Wrapper around ioctl() */
 static int fetch_if_ioctl(int fd_socket, char const *if_name, int req_num,
 			  char const *req_num_str, struct ifreq *req) {
@@ -250,18 +787,97 @@ static int fetch_if_mtu(int fd_socket, char const *if_name, int *ptr_mtu) {
     return 1;
 }
 
+/* Wrapper around the SIOCGIFHWADDR ioctl */
+static int fetch_if_hwaddr(int fd_socket, char const *if_name,
+                           unsigned char *ptr_result) {
+    struct ifreq req;
+    if (!fetch_if_ioctl(fd_socket, if_name, SIOCGIFHWADDR, "SIOCGIFHWADDR", &req)) {
+	return 0;
+    }
+    memcpy(ptr_result, req.ifr_hwaddr.sa_data, ETH_ALEN);
+    return 1;
+}
+
+/*
+ * Trunk mode counterpart of the per-interface checks in parse_command_line().
+ * There are no VLAN interfaces to query for addresses, so these must all have
+ * been specified explicitly.
+ */
+static int parse_trunk_interface(int fd_socket_tmp) {
+    int i;
+    unsigned short flags;
+    char display[INET_ADDRSTRLEN + 1];
+    int mtu;
+
+    if (!fetch_if_flags(fd_socket_tmp, trunk_if_name_, &flags)) {
+        return 0;
+    }
+    if ((flags & IFF_LOOPBACK) != 0) {
+        EPRINT("Loopback interface %s is not supported\n", trunk_if_name_);
+        return 0;
+    }
+    if ((flags & IFF_UP) == 0) {
+        EPRINT("Interface %s is not up\n", trunk_if_name_);
+        return 0;
+    }
+    if (!fetch_if_hwaddr(fd_socket_tmp, trunk_if_name_, trunk_mac_)) {
+        return 0;
+    }
+    if (!fetch_if_mtu(fd_socket_tmp, trunk_if_name_, &mtu)) {
+        return 0;
+    }
+    largest_mtu_ = (mtu == 0) ? 4096 : mtu;
+
+    for (i = 0; i < (int) nifs_; i++) {
+        struct Iface *thisif = &(ifs_[i]);
+        char const *side = (i == IFS_LEFT) ? "left" : "right";
+
+        thisif->mtu = largest_mtu_;
+
+        if (thisif->srcaddrtype == SRCA_IFADDR) {
+            EPRINT("\"--%s-src ifaddr\" is not supported with \"--trunk\"\n",
+                   side);
+            return 0;
+        }
+        if (thisif->dstaddrtype == DSTA_BROADCAST) {
+            EPRINT("\"--%s-dst broadcast\" is not supported with \"--trunk\"; "
+                   "specify the broadcast address of the VLAN\n", side);
+            return 0;
+        }
+
+        printf("%s vlan %u: ", trunk_if_name_, (unsigned) thisif->vlan_id);
+
+        inet_ntop(AF_INET, &(thisif->srcaddr), display, INET_ADDRSTRLEN);
+        display[INET_ADDRSTRLEN] = '\0';
+        if (thisif->srcaddrtype == SRCA_UNCHANGED) {
+            printf("src (unchanged) ");
+        } else {
+            printf("src %s (specified) ", display);
+        }
+
+        inet_ntop(AF_INET, &(thisif->dstaddr), display, INET_ADDRSTRLEN);
+        display[INET_ADDRSTRLEN] = '\0';
+        printf("dst %s (specified)\n", display);
+    }
+
+    return 1;
+}
+
 /*
  * Set up global variables from command line arguments.
  */
 static int parse_command_line(int argc, char **argv) {
     int i;
+    unsigned int j;
     char *endptr, *left_if_name = 0, *right_if_name = 0;
     unsigned long ulvalue;
     unsigned int lif = (unsigned int) -1;
     unsigned int rif = (unsigned int) -1;
+    unsigned int ntrunk_vlans = 0;
+    int sides = 0; /* --left-* or --right-* options given */
     int fd_socket_tmp;
 
-    if ((argc < 15) || (argc > 19)) {
+    if (argc < 9) {
         print_usage_and_exit(argv[0]);
     }
 
@@ -330,6 +946,107 @@ static int parse_command_line(int argc, char **argv) {
                 return 0;
             }
             right_if_name = argv[i];
+        } else if (0 == strcmp("--trunk", argv[i])) {
+            if (trunk_if_name_) {
+                EPRINT("\"%s\" specified multiple times\n", argv[i]);
+                return 0;
+            }
+            i++;
+            if (i == argc) {
+                EPRINT("\"%s\" needs an argument\n", argv[i - 1]);
+                return 0;
+            }
+            trunk_ifindex_ = if_nametoindex(argv[i]);
+            if (trunk_ifindex_ == 0) {
+                EPRINT("Interface \"%s\" is invalid: %s\n", argv[i], strerror(errno));
+                return 0;
+            }
+            trunk_if_name_ = argv[i];
+        } else if ((0 == strcmp("--left-vlan", argv[i])) ||
+                   (0 == strcmp("--right-vlan", argv[i]))) {
+            struct Iface *ifsptr;
+            if (argv[i][2] == 'l') {
+                ifsptr = &(ifs_[IFS_LEFT]);
+            } else {
+                ifsptr = &(ifs_[IFS_RIGHT]);
+            }
+
+            if (ntrunk_vlans) {
+                EPRINT("\"%s\" cannot be combined with \"--trunk-vlan\"\n", argv[i]);
+                return 0;
+            }
+            sides = 1;
+
+            if (ifsptr->vlan_id != 0) {
+                EPRINT("\"%s\" specified more than once\n", argv[i]);
+                return 0;
+            }
+            i++;
+            if (i == argc) {
+                EPRINT("\"%s\" needs an argument\n", argv[i - 1]);
+                return 0;
+            }
+            ulvalue = strtoul(argv[i], &endptr, 0);
+            if (*endptr || !ulvalue || (ulvalue >= VLAN_VID_MASK)) {
+                EPRINT("\"%s\" is not a valid VLAN ID\n", argv[i]);
+                return 0;
+            }
+            ifsptr->vlan_id = (unsigned short) ulvalue;
+        } else if (0 == strcmp("--trunk-vlan", argv[i])) {
+            struct Iface *ifsptr = &(ifs_[ntrunk_vlans]);
+            char addrstr[INET_ADDRSTRLEN];
+            char *sep = 0;
+
+            if (sides) {
+                EPRINT("\"%s\" cannot be combined with the \"--left-*\" and "
+                       "\"--right-*\" options\n", argv[i]);
+                return 0;
+            }
+            i++;
+            if (i == argc) {
+                EPRINT("\"%s\" needs an argument\n", argv[i - 1]);
+                return 0;
+            }
+            if (ntrunk_vlans == TRUNK_MAX_VLANS) {
+                EPRINT("Too many \"%s\" (at most %d)\n", argv[i - 1],
+                       TRUNK_MAX_VLANS);
+                return 0;
+            }
+            /* <vid>:<src>:<dst> */
+            ulvalue = strtoul(argv[i], &endptr, 10);
+            if ((endptr != argv[i]) && (*endptr == ':')) {
+                sep = strchr(endptr + 1, ':');
+            }
+            if (sep && (sep - endptr - 1 < INET_ADDRSTRLEN)) {
+                memcpy(addrstr, endptr + 1, sep - endptr - 1);
+                addrstr[sep - endptr - 1] = '\0';
+                if (0 == strcmp(addrstr, "unchanged")) {
+                    ifsptr->srcaddrtype = SRCA_UNCHANGED;
+                } else if (1 == inet_pton(AF_INET, addrstr, &(ifsptr->srcaddr))) {
+                    ifsptr->srcaddrtype = SRCA_SPECIFIED;
+                } else {
+                    sep = 0;
+                }
+            } else {
+                sep = 0;
+            }
+            if (!sep || !ulvalue || (ulvalue >= VLAN_VID_MASK) ||
+                (1 != inet_pton(AF_INET, sep + 1, &(ifsptr->dstaddr)))) {
+                EPRINT("\"%s\" is not a valid value for \"%s\": expecting "
+                       "<vid>:<src>:<dst>, with a VLAN ID from 1 to 4094, "
+                       "\"unchanged\" or an IPv4 address as <src>, and an IPv4 "
+                       "address as <dst>\n", argv[i], argv[i - 1]);
+                return 0;
+            }
+            ifsptr->dstaddrtype = DSTA_SPECIFIED;
+            ifsptr->vlan_id = (unsigned short) ulvalue;
+            for (j = 0; j < ntrunk_vlans; j++) {
+                if (ifs_[j].vlan_id == ifsptr->vlan_id) {
+                    EPRINT("VLAN %lu specified multiple times\n", ulvalue);
+                    return 0;
+                }
+            }
+            ntrunk_vlans++;
         } else if ((0 == strcmp("--left-src", argv[i])) ||
                    (0 == strcmp("--right-src", argv[i]))) {
             struct Iface *ifsptr;
@@ -339,6 +1056,12 @@ static int parse_command_line(int argc, char **argv) {
                 ifsptr = &(ifs_[IFS_RIGHT]);
             }
 
+            if (ntrunk_vlans) {
+                EPRINT("\"%s\" cannot be combined with \"--trunk-vlan\"\n", argv[i]);
+                return 0;
+            }
+            sides = 1;
+
             if (ifsptr->srcaddrtype != SRCA_INVALID) {
                 EPRINT("\"%s\" specified more than once\n", argv[i]);
                 return 0;
@@ -372,6 +1095,12 @@ static int parse_command_line(int argc, char **argv) {
                 ifsptr = &(ifs_[IFS_RIGHT]);
             }
 
+            if (ntrunk_vlans) {
+                EPRINT("\"%s\" cannot be combined with \"--trunk-vlan\"\n", argv[i]);
+                return 0;
+            }
+            sides = 1;
+
             if (ifsptr->dstaddrtype != DSTA_INVALID) {
                 EPRINT("\"%s\" specified more than once\n", argv[i]);
                 return 0;
@@ -393,37 +1122,394 @@ static int parse_command_line(int argc, char **argv) {
                     ifsptr->dstaddrtype = DSTA_SPECIFIED;
                 }
             }
-        } else if (0 == strcmp("--debug", argv[i])) {
-            debug_ = 1;
-        } else if (0 == strcmp("--fork", argv[i])) {
-            fork_ = 1;
-        } else {
-            EPRINT("Argument \"%s\" is not understood\n", argv[i]);
-            return 0;
-        }
-    }
-
-    /* Check if we have everything we need */
-
-    if (udport_ == 0) {
-        EPRINT("\"--port\" not specified.\n");
-        return 0;
-    }
-
-    if ((!left_if_name) || (lif == (unsigned int) -1)) {
-        EPRINT("\"--left\" not specified.\n");
-        return 0;
-    }
-    ifs_[IFS_LEFT].ifindex = lif;
+        } else if (0 == strcmp("--xdp", argv[i])) {
+            if (xsk_mode_ != XSK_MODE_OFF) {
+                EPRINT("\"%s\" specified multiple times\n", argv[i]);
+                return 0;
+            }
+            i++;
+            if (i == argc) {
+                EPRINT("\"%s\" needs an argument\n", argv[i - 1]);
+                return 0;
+            }
+            if (0 == strcmp(argv[i], "auto")) {
+                xsk_mode_ = XSK_MODE_AUTO;
+            } else if (0 == strcmp(argv[i], "native")) {
+                xsk_mode_ = XSK_MODE_NATIVE;
+            } else if (0 == strcmp(argv[i], "skb")) {
+                xsk_mode_ = XSK_MODE_SKB;
+            } else {
+                EPRINT("\"%s\" is not a valid value for \"%s\": expecting "
+                       "\"auto\", \"native\" or \"skb\"\n", argv[i], argv[i - 1]);
+                return 0;
+            }
+        } else if (0 == strcmp("--mcast-group", argv[i])) {
+            struct McastGroup *group = &(mcast_groups_[nmcast_groups_]);
+            char addrstr[INET_ADDRSTRLEN];
 
-    if ((!right_if_name) || (rif == (unsigned int) -1)) {
-        EPRINT("\"--right\" not specified.\n");
-        return 0;
-    }
-    ifs_[IFS_RIGHT].ifindex = rif;
+            i++;
+            if (i == argc) {
+                EPRINT("\"%s\" needs an argument\n", argv[i - 1]);
+                return 0;
+            }
+            if (nmcast_groups_ == MCAST_MAX_GROUPS) {
+                EPRINT("Too many \"%s\" (at most %d)\n", argv[i - 1],
+                       MCAST_MAX_GROUPS);
+                return 0;
+            }
+            /* <group>:<port> */
+            endptr = strchr(argv[i], ':');
+            if (endptr && (endptr - argv[i] < INET_ADDRSTRLEN)) {
+                memcpy(addrstr, argv[i], endptr - argv[i]);
+                addrstr[endptr - argv[i]] = '\0';
+                ulvalue = strtoul(endptr + 1, &endptr, 10);
+            } else {
+                endptr = 0;
+            }
+            if (!endptr || *endptr || !ulvalue || (ulvalue > 65535) ||
+                (1 != inet_pton(AF_INET, addrstr, &(group->addr))) ||
+                !IN_MULTICAST(ntohl(group->addr.s_addr))) {
+                EPRINT("\"%s\" is not a valid value for \"%s\": expecting "
+                       "<multicast group>:<port>\n", argv[i], argv[i - 1]);
+                return 0;
+            }
+            group->port = (unsigned short) ulvalue;
+            group->socket = -1;
+            for (j = 0; j < nmcast_groups_; j++) {
+                if ((mcast_groups_[j].addr.s_addr == group->addr.s_addr) &&
+                    (mcast_groups_[j].port == group->port)) {
+                    EPRINT("\"%s\" specified multiple times\n", argv[i]);
+                    return 0;
+                }
+            }
+            nmcast_groups_++;
+        } else if (0 == strcmp("--tc", argv[i])) {
+            if (tc_mode_) {
+                EPRINT("\"%s\" specified multiple times\n", argv[i]);
+                return 0;
+            }
+            tc_mode_ = 1;
+        } else if (0 == strcmp("--handover", argv[i])) {
+            if (handover_path_) {
+                EPRINT("\"%s\" specified multiple times\n", argv[i]);
+                return 0;
+            }
+            i++;
+            if (i == argc) {
+                EPRINT("\"%s\" needs an argument\n", argv[i - 1]);
+                return 0;
+            }
+            if (strlen(argv[i]) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+                EPRINT("\"%s\" is too long for a UNIX socket path\n", argv[i]);
+                return 0;
+            }
+            handover_path_ = argv[i];
+        } else if (0 == strcmp("--capture", argv[i])) {
+            if (capture_path_) {
+                EPRINT("\"%s\" specified multiple times\n", argv[i]);
+                return 0;
+            }
+            i++;
+            if (i == argc) {
+                EPRINT("\"%s\" needs an argument\n", argv[i - 1]);
+                return 0;
+            }
+            capture_path_ = argv[i];
+        } else if (0 == strcmp("--capture-size", argv[i])) {
+            if (capture_mb_ != 0) {
+                EPRINT("\"%s\" specified multiple times\n", argv[i]);
+                return 0;
+            }
+            i++;
+            if (i == argc) {
+                EPRINT("\"%s\" needs an argument\n", argv[i - 1]);
+                return 0;
+            }
+            ulvalue = strtoul(argv[i], &endptr, 0);
+            if (*endptr || !ulvalue || (ulvalue > CAPTURE_MAX_MB)) {
+                EPRINT("\"%s\" is not a valid capture file size\n", argv[i]);
+                return 0;
+            }
+            capture_mb_ = ulvalue;
+        } else if (0 == strcmp("--class", argv[i])) {
+            struct ClassRule *rule = &(class_rules_[nclass_rules_]);
+            char *arg;
 
-    if (ifs_[IFS_LEFT].dstaddrtype == DSTA_INVALID) {
-        EPRINT("\"--left-dst\" is a mandatory argument.\n");
+            if (nclass_rules_ == SCHED_MAX_RULES) {
+                EPRINT("Too many \"%s\" rules\n", argv[i]);
+                return 0;
+            }
+            i++;
+            if (i == argc) {
+                EPRINT("\"%s\" needs an argument\n", argv[i - 1]);
+                return 0;
+            }
+            if (0 == strncmp(argv[i], "sport:", 6)) {
+                rule->match = MATCH_SPORT;
+                arg = argv[i] + 6;
+            } else if (0 == strncmp(argv[i], "dscp:", 5)) {
+                rule->match = MATCH_DSCP;
+                arg = argv[i] + 5;
+            } else {
+                arg = 0;
+            }
+            if (arg) {
+                rule->value = strtoul(arg, &endptr, 0);
+                if (*endptr == ':') {
+                    rule->cls = strtoul(endptr + 1, &endptr, 0);
+                } else {
+                    arg = 0;
+                }
+            }
+            if (!arg || *endptr || (rule->cls >= SCHED_CLASSES) ||
+                (rule->value > ((rule->match == MATCH_SPORT) ? 65535 : 63))) {
+                EPRINT("\"%s\" is not a valid value for \"%s\": expecting "
+                       "sport:<port>:<class> or dscp:<dscp>:<class>, with a class "
+                       "from 0 to %d\n", argv[i], argv[i - 1], SCHED_CLASSES - 1);
+                return 0;
+            }
+            nclass_rules_++;
+        } else if (0 == strcmp("--sched", argv[i])) {
+            if (sched_set_) {
+                EPRINT("\"%s\" specified multiple times\n", argv[i]);
+                return 0;
+            }
+            i++;
+            if (i == argc) {
+                EPRINT("\"%s\" needs an argument\n", argv[i - 1]);
+                return 0;
+            }
+            sched_set_ = 1;
+            if (0 == strcmp(argv[i], "strict")) {
+                sched_ = SCHED_STRICT;
+            } else if ((0 == strcmp(argv[i], "drr")) ||
+                       (0 == strncmp(argv[i], "drr:", 4))) {
+                unsigned int c;
+
+                sched_ = SCHED_DRR;
+                endptr = argv[i] + 3;
+                for (c = 0; (c < SCHED_CLASSES) && *endptr; c++) {
+                    ulvalue = strtoul(endptr + 1, &endptr, 0);
+                    if (!ulvalue || (ulvalue > 1000) ||
+                        ((c < SCHED_CLASSES - 1) ? (*endptr != ',') : (*endptr != '\0'))) {
+                        EPRINT("\"%s\" is not a valid value for \"%s\": expecting "
+                               "%d weights from 1 to 1000\n", argv[i], argv[i - 1],
+                               SCHED_CLASSES);
+                        return 0;
+                    }
+                    sched_weights_[c] = ulvalue;
+                }
+            } else {
+                EPRINT("\"%s\" is not a valid value for \"%s\": expecting "
+                       "\"strict\" or \"drr\"\n", argv[i], argv[i - 1]);
+                return 0;
+            }
+        } else if (0 == strcmp("--queue-depth", argv[i])) {
+            unsigned int *depth = &queue_depth_;
+
+            i++;
+            if (i == argc) {
+                EPRINT("\"%s\" needs an argument\n", argv[i - 1]);
+                return 0;
+            }
+            /* [<class>:]<n> */
+            ulvalue = strtoul(argv[i], &endptr, 0);
+            if ((endptr != argv[i]) && (*endptr == ':') && (ulvalue < SCHED_CLASSES)) {
+                depth = &(queue_depths_[ulvalue]);
+                ulvalue = strtoul(endptr + 1, &endptr, 0);
+            }
+            if (*endptr || !ulvalue || (ulvalue > SCHED_MAX_DEPTH)) {
+                EPRINT("\"%s\" is not a valid value for \"%s\": expecting "
+                       "[<class>:]<n>, with a class from 0 to %d and a depth from "
+                       "1 to %d\n", argv[i], argv[i - 1], SCHED_CLASSES - 1,
+                       SCHED_MAX_DEPTH);
+                return 0;
+            }
+            if (*depth != 0) {
+                EPRINT("\"%s\" specified multiple times for the same queues\n",
+                       argv[i - 1]);
+                return 0;
+            }
+            *depth = ulvalue;
+            queue_depth_set_ = 1;
+        } else if (0 == strcmp("--queue-drop", argv[i])) {
+            if (queue_drop_head_ != -1) {
+                EPRINT("\"%s\" specified multiple times\n", argv[i]);
+                return 0;
+            }
+            i++;
+            if (i == argc) {
+                EPRINT("\"%s\" needs an argument\n", argv[i - 1]);
+                return 0;
+            }
+            if (0 == strcmp(argv[i], "tail")) {
+                queue_drop_head_ = 0;
+            } else if (0 == strcmp(argv[i], "head")) {
+                queue_drop_head_ = 1;
+            } else {
+                EPRINT("\"%s\" is not a valid value for \"%s\": expecting "
+                       "\"tail\" or \"head\"\n", argv[i], argv[i - 1]);
+                return 0;
+            }
+        } else if (0 == strcmp("--tos", argv[i])) {
+            if (tos_set_) {
+                EPRINT("\"%s\" specified multiple times\n", argv[i]);
+                return 0;
+            }
+            i++;
+            if (i == argc) {
+                EPRINT("\"%s\" needs an argument\n", argv[i - 1]);
+                return 0;
+            }
+            tos_set_ = 1;
+            if (0 == strcmp(argv[i], "preserve")) {
+                tos_ = TOS_PRESERVE;
+            } else {
+                ulvalue = strtoul(argv[i], &endptr, 0);
+                if (*endptr || (ulvalue > 255)) {
+                    EPRINT("\"%s\" is not a valid value for \"%s\": expecting "
+                           "\"preserve\" or 0-255\n", argv[i], argv[i - 1]);
+                    return 0;
+                }
+                tos_ = (int) ulvalue;
+            }
+        } else if (0 == strcmp("--tos-map", argv[i])) {
+            unsigned long to;
+
+            i++;
+            if (i == argc) {
+                EPRINT("\"%s\" needs an argument\n", argv[i - 1]);
+                return 0;
+            }
+            ulvalue = strtoul(argv[i], &endptr, 0);
+            to = 64;
+            if ((endptr != argv[i]) && (*endptr == '=') &&
+                (endptr[1] >= '0') && (endptr[1] <= '9')) {
+                to = strtoul(endptr + 1, &endptr, 0);
+            }
+            if (*endptr || (ulvalue > 63) || (to > 63)) {
+                EPRINT("\"%s\" is not a valid value for \"%s\": expecting "
+                       "<dscp>=<dscp>, with DSCPs from 0 to 63\n", argv[i], argv[i - 1]);
+                return 0;
+            }
+            if (tos_mapped_ & (1ull << ulvalue)) {
+                EPRINT("DSCP %lu is mapped multiple times\n", ulvalue);
+                return 0;
+            }
+            tos_map_[ulvalue] = (unsigned char) to;
+            tos_mapped_ |= 1ull << ulvalue;
+        } else if (0 == strcmp("--debug", argv[i])) {
+            debug_ = 1;
+        } else if (0 == strcmp("--fork", argv[i])) {
+            fork_ = 1;
+        } else {
+            EPRINT("Argument \"%s\" is not understood\n", argv[i]);
+            return 0;
+        }
+    }
+
+    /* Check if we have everything we need */
+
+    if (capture_mb_ && !capture_path_) {
+        EPRINT("\"--capture-size\" needs \"--capture\".\n");
+        return 0;
+    }
+
+    if (trunk_if_name_ && (nclass_rules_ || sched_set_ || queue_depth_set_ ||
+                           (queue_drop_head_ != -1) || tos_set_ || tos_mapped_)) {
+        EPRINT("Scheduling options are not supported with \"--trunk\".\n");
+        return 0;
+    }
+    /* The UMEM of the AF_XDP sockets is our own memory, and cannot be handed
+       over to another process */
+    if ((xsk_mode_ != XSK_MODE_OFF) && (trunk_if_name_ || handover_path_)) {
+        EPRINT("\"--xdp\" is not supported with \"--trunk\" or \"--handover\".\n");
+        return 0;
+    }
+    if (tc_mode_ && (trunk_if_name_ || (xsk_mode_ != XSK_MODE_OFF))) {
+        EPRINT("\"--tc\" is not supported with \"--trunk\" or \"--xdp\".\n");
+        return 0;
+    }
+    if (nmcast_groups_ && trunk_if_name_) {
+        EPRINT("\"--mcast-group\" is not supported with \"--trunk\".\n");
+        return 0;
+    }
+    /* The fast paths take every datagram for --port, whatever its destination */
+    for (j = 0; j < nmcast_groups_; j++) {
+        if ((mcast_groups_[j].port == udport_) &&
+            (tc_mode_ || (xsk_mode_ != XSK_MODE_OFF))) {
+            EPRINT("A \"--mcast-group\" on the \"--port\" is not supported with "
+                   "\"--xdp\" or \"--tc\".\n");
+            return 0;
+        }
+    }
+    if (queue_depth_ == 0) {
+        queue_depth_ = SCHED_DEFAULT_DEPTH;
+    }
+    for (j = 0; j < SCHED_CLASSES; j++) {
+        if (queue_depths_[j] == 0) {
+            queue_depths_[j] = queue_depth_;
+        }
+    }
+    if (queue_drop_head_ == -1) {
+        queue_drop_head_ = 0;
+    }
+
+    if (udport_ == 0) {
+        EPRINT("\"--port\" not specified.\n");
+        return 0;
+    }
+
+    if (trunk_if_name_) {
+        if (left_if_name || right_if_name) {
+            EPRINT("\"--left\" and \"--right\" cannot be used with \"--trunk\"; "
+                   "use \"--left-vlan\" and \"--right-vlan\".\n");
+            return 0;
+        }
+        if (ntrunk_vlans == 1) {
+            EPRINT("\"--trunk-vlan\" needs to be specified at least twice.\n");
+            return 0;
+        }
+        if (ntrunk_vlans) {
+            nifs_ = ntrunk_vlans;
+        } else if (ifs_[IFS_LEFT].vlan_id == 0) {
+            EPRINT("\"--left-vlan\" not specified.\n");
+            return 0;
+        }
+        if (ifs_[IFS_RIGHT].vlan_id == 0) {
+            EPRINT("\"--right-vlan\" not specified.\n");
+            return 0;
+        }
+        if (ifs_[IFS_LEFT].vlan_id == ifs_[IFS_RIGHT].vlan_id) {
+            EPRINT("\"--left-vlan\" and \"--right-vlan\" must be different.\n");
+            return 0;
+        }
+        for (j = 0; j < nifs_; j++) {
+            ifs_[j].ifindex = trunk_ifindex_;
+        }
+    } else {
+        if ((ifs_[IFS_LEFT].vlan_id != 0) || (ifs_[IFS_RIGHT].vlan_id != 0) ||
+            ntrunk_vlans) {
+            EPRINT("\"--left-vlan\", \"--right-vlan\" and \"--trunk-vlan\" need "
+                   "\"--trunk\".\n");
+            return 0;
+        }
+
+        if ((!left_if_name) || (lif == (unsigned int) -1)) {
+            EPRINT("\"--left\" not specified.\n");
+            return 0;
+        }
+        ifs_[IFS_LEFT].ifindex = lif;
+
+        if ((!right_if_name) || (rif == (unsigned int) -1)) {
+            EPRINT("\"--right\" not specified.\n");
+            return 0;
+        }
+        ifs_[IFS_RIGHT].ifindex = rif;
+    }
+
+    if (ifs_[IFS_LEFT].dstaddrtype == DSTA_INVALID) {
+        EPRINT("\"--left-dst\" is a mandatory argument.\n");
         return 0;
     }
 
@@ -442,11 +1528,16 @@ static int parse_command_line(int argc, char **argv) {
         return 0;
     }
 
-    if ((ifs_[IFS_LEFT].srcaddrtype == SRCA_UNCHANGED) ||
-	(ifs_[IFS_RIGHT].srcaddrtype == SRCA_UNCHANGED)) {
+    for (j = 0; j < nifs_; j++) {
+        if (ifs_[j].srcaddrtype == SRCA_UNCHANGED) {
+            break;
+        }
+    }
+    if (j < nifs_) {
 	if (echo_marker_ttl_ == 0) {
 	    EPRINT("\"--echo-marker\" is needed when either \"--left-src\" or "
-		   "\"--right-dst\" is specified as \"unchanged\"\n");
+		   "\"--right-dst\" (or the <src> of a \"--trunk-vlan\") is "
+		   "specified as \"unchanged\"\n");
 	    return 0;
 	}
     } else {
@@ -464,6 +1555,12 @@ static int parse_command_line(int argc, char **argv) {
         return 0;
     }
 
+    if (trunk_if_name_) {
+        int ret = parse_trunk_interface(fd_socket_tmp);
+        close(fd_socket_tmp);
+        return ret;
+    }
+
     for (i = 0; i < MAXIFS; i++) {
         struct Iface *thisif = &(ifs_[i]);
         char *this_if_name;
@@ -554,6 +1651,7 @@ static int parse_command_line(int argc, char **argv) {
         if (mtu == 0) {
             mtu = 4096;
         }
+        thisif->mtu = mtu;
         if (mtu > largest_mtu_) {
             largest_mtu_ = mtu;
         }
@@ -588,6 +1686,29 @@ static int parse_command_line(int argc, char **argv) {
     return 1;
 }
 
+/*
+ * Send the multicast datagrams relayed to `thisif` out of it, and don't loop
+ * them back to our own group sockets.
+ */
+static int setup_raw_mcast(int fd_socket, struct Iface const *thisif,
+                           char const *ifname) {
+    struct ip_mreqn mreq;
+    unsigned char no = 0;
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_ifindex = thisif->ifindex;
+    if (setsockopt(fd_socket, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) < 0) {
+        EPRINT("Error setting IP_MULTICAST_IF on %s: %s\n", ifname, strerror(errno));
+        return 0;
+    }
+    if (setsockopt(fd_socket, IPPROTO_IP, IP_MULTICAST_LOOP, &no, sizeof(no)) < 0) {
+        EPRINT("Error setting IP_MULTICAST_LOOP on %s: %s\n", ifname,
+               strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
 static int setup_raw_socket(struct Iface *thisif) {
     char ifname[IF_NAMESIZE + 1];
     int yes = 1;
@@ -632,13 +1753,18 @@ static int setup_raw_socket(struct Iface *thisif) {
         return 0;
     }
 
+    if (nmcast_groups_ && !setup_raw_mcast(thisif->raw_socket, thisif, ifname)) {
+        return 0;
+    }
+
     return 1;
 }
 
-static int setup_udp_socket(unsigned short port) {
+static int setup_udp_socket(struct in_addr addr, unsigned short port) {
     int fd_socket;
     struct sockaddr_in bind_addr;
     int yes = 1;
+    int no = 0;
 
     if ((fd_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
         EPRINT("Failed to create UDP socket: %s\n", strerror(errno));
@@ -669,6 +1795,12 @@ static int setup_udp_socket(unsigned short port) {
         return -1;
     }
 
+    yes = 1;
+    if (setsockopt(fd_socket, SOL_IP, IP_RECVTOS, &yes, sizeof(yes)) < 0) {
+        EPRINT("Failed to set IP_RECVTOS on UDP socket: %s\n", strerror(errno));
+        return -1;
+    }
+
     yes = 1;
     if (setsockopt(fd_socket, SOL_IP, IP_RECVORIGDSTADDR, &yes, sizeof(yes)) < 0) {
         EPRINT("Failed to set IP_RECVORIGDSTADDR on UDP socket: %s\n",
@@ -676,9 +1808,17 @@ static int setup_udp_socket(unsigned short port) {
         return -1;
     }
 
+    /* Only receive the multicast groups joined on this very socket */
+    no = 0;
+    if (setsockopt(fd_socket, SOL_IP, IP_MULTICAST_ALL, &no, sizeof(no)) < 0) {
+        EPRINT("Failed to set IP_MULTICAST_ALL on UDP socket: %s\n",
+               strerror(errno));
+        return -1;
+    }
+
     bind_addr.sin_family = AF_INET;
     bind_addr.sin_port = htons(port);
-    bind_addr.sin_addr.s_addr = INADDR_ANY;
+    bind_addr.sin_addr = addr;
     if(bind(fd_socket, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) < 0) {
         EPRINT("Failed to bind UDP socket to port %u: %s\n", (unsigned) port,
 	       strerror(errno));
@@ -688,124 +1828,2661 @@ static int setup_udp_socket(unsigned short port) {
     return fd_socket;
  }
 
-int main(int argc,char **argv) {
-    unsigned int i, j;
-    unsigned char *buf;
-    char ipstr[INET_ADDRSTRLEN + 1];
-    char ifname[IF_NAMESIZE + 1];
-    int fd_udp_socket;
-
-    openlog("ubrr", LOG_PID | LOG_CONS, LOG_LOCAL1);
-    if (!parse_command_line(argc, argv)) {
-	closelog();
-        exit(1);
-    }
-    if (debug_ == 0) {
-	setlogmask(LOG_UPTO (LOG_INFO));
-    }
+/*
+ * Join multicast group `group` on both interfaces, with its socket. The
+ * socket may be one handed over by the previous relay, and have joined the
+ * group on some of them already.
+ */
+static int setup_mcast_group(struct McastGroup const *group) {
+    struct ip_mreqn mreq;
+    char display[INET_ADDRSTRLEN + 1];
+    unsigned int i;
 
+    display[INET_ADDRSTRLEN] = '\0';
+    inet_ntop(AF_INET, &(group->addr), display, INET_ADDRSTRLEN);
     for (i = 0; i < MAXIFS; i++) {
-        if (!setup_raw_socket(&(ifs_[i]))) {
-            for (j = 0; j < i; j++) {
-                close(ifs_[j].raw_socket);
-            }
-	    closelog();
-            exit(1);
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.imr_multiaddr = group->addr;
+        mreq.imr_ifindex = ifs_[i].ifindex;
+        if ((setsockopt(group->socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                        sizeof(mreq)) < 0) && (errno != EADDRINUSE)) {
+            EPRINT("Failed to join multicast group %s on interface %u: %s\n",
+                   display, ifs_[i].ifindex, strerror(errno));
+            return 0;
         }
     }
+    printf("Multicast group %s port %u\n", display, (unsigned) group->port);
+    return 1;
+}
 
-    /* Create our broadcast receiving socket */
-    if ((fd_udp_socket = setup_udp_socket(udport_)) == -1) {
-        for (i = 0; i < MAXIFS; i++) {
-            close(ifs_[i].raw_socket);
-        }
-	closelog();
-        exit(1);
+/*
+ * Attach a classic BPF filter to the trunk socket so that only IPv4/UDP frames
+ * for our port (tagged, or with the tag stripped into the auxdata) wake us up.
+ */
+static int attach_trunk_filter(int fd_socket) {
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),                    /* ethertype */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_8021Q, 8, 0),
+        /* untagged (or tag offloaded): IP header at 14 */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 17),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 14 + 9),                /* protocol */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 15),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 14 + 6),                /* frag_off */
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 13, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),                   /* ihl * 4 */
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 14 + 2),                /* dest port */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, udport_, 9, 10),
+        /* 802.1Q tag inline: IP header at 18 */
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 16),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 8),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 18 + 9),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 18 + 6),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 18),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 18 + 2),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, udport_, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0x40000),                        /* accept */
+        BPF_STMT(BPF_RET | BPF_K, 0)                               /* reject */
+    };
+    struct sock_fprog fprog;
+
+    fprog.len = sizeof(filter) / sizeof(filter[0]);
+    fprog.filter = filter;
+    if (setsockopt(fd_socket, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+                   sizeof(fprog)) < 0) {
+        EPRINT("Failed to attach filter to trunk socket: %s\n", strerror(errno));
+        return 0;
     }
+    return 1;
+}
 
-    printf("Largest MTU: %d\n", largest_mtu_);
+static int setup_trunk_socket(void) {
+    int fd_socket;
+    struct sockaddr_ll bind_addr;
+    int yes = 1;
 
-    /* Create the buffer that will hold the packet content */
-    largest_mtu_ += 32; /* add some extra room just in case */
-    /* Add room for the IP and UDP headers */
-    largest_mtu_ += sizeof(struct iphdr) + sizeof(struct udphdr);
+    /* Protocol 0 so that nothing is queued before the filter is in place */
+    if ((fd_socket = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+        EPRINT("Failed to create packet socket on %s: %s\n", trunk_if_name_,
+               strerror(errno));
+        return -1;
+    }
 
-    buf = malloc(largest_mtu_);
-    if (!buf) {
-        EPRINT("Failed to create %d-byte packet buffer\n", largest_mtu_);
-        for (i = 0; i < MAXIFS; i++) {
-            close(ifs_[i].raw_socket);
-        }
-	closelog();
-        exit(1);
+    /* Frames usually arrive with the tag already stripped by the NIC or the
+       kernel; it is then reported in the auxiliary data */
+    yes = 1;
+    if (setsockopt(fd_socket, SOL_PACKET, PACKET_AUXDATA, &yes, sizeof(yes)) < 0) {
+        EPRINT("Failed to set PACKET_AUXDATA on packet socket: %s\n",
+               strerror(errno));
+        close(fd_socket);
+        return -1;
     }
 
-    /* Fork to background */
+    /* Don't receive our own transmissions. Older kernels lack this option,
+       so outgoing frames are also skipped by packet type in trunk_loop() */
+    yes = 1;
+    if (setsockopt(fd_socket, SOL_PACKET, PACKET_IGNORE_OUTGOING, &yes,
+                   sizeof(yes)) < 0) {
+        DPRINT("PACKET_IGNORE_OUTGOING not supported: %s\n", strerror(errno));
+    }
 
-    if (fork_ && fork()) {
-	exit(0);
+    if (!attach_trunk_filter(fd_socket)) {
+        close(fd_socket);
+        return -1;
     }
-    fclose(stdin);
-    fclose(stdout);
-    fclose(stderr);
-    forked_ = 1;
 
-    for (;;) /* endless loop */
-    {
-        struct sockaddr_in rcv_addr, snd_addr;
-        struct msghdr rcv_msg;
-        struct iovec iov;
-        struct in_pktinfo rcv_pkt_info;
-        struct sockaddr_in rcv_dst_addr;
-	unsigned long rcv_pkt_ttl;
-        struct Iface *txiface, *rxiface;
-        struct cmsghdr *cmsg;
-        struct iphdr *ip;
-        struct udphdr *udp;
+    memset(&bind_addr, 0, sizeof(bind_addr));
+    bind_addr.sll_family = AF_PACKET;
+    bind_addr.sll_protocol = htons(ETH_P_ALL);
+    bind_addr.sll_ifindex = trunk_ifindex_;
+    if (bind(fd_socket, (struct sockaddr *) &bind_addr, sizeof(bind_addr)) < 0) {
+        EPRINT("Failed to bind packet socket to %s: %s\n", trunk_if_name_,
+               strerror(errno));
+        close(fd_socket);
+        return -1;
+    }
 
-        ssize_t rcv_msg_len;
-        u_char pkt_infos[CMSG_SPACE(sizeof(struct in_pktinfo)) +
-			 CMSG_SPACE(4) +
-			 CMSG_SPACE(sizeof(struct sockaddr_in))];
+    return fd_socket;
+}
 
-        /* The IPv4 header goes at the beginning of `buf`*/
-        ip = (struct iphdr *) buf;
-        /* The UDP header follows */
-        udp = (struct udphdr *) (buf + sizeof(*ip));
+/*
+ * Enable UDP GRO on the receiving socket. This is an optimization only, so
+ * it's fine if the kernel doesn't support it.
+ */
+static int enable_udp_gro(int fd_socket) {
+    int yes = 1;
 
-        /* The received UDP datagram follows the UDP header */
-        iov.iov_base = buf + sizeof(*ip) + sizeof(*udp);
-        iov.iov_len = largest_mtu_ - (sizeof(*ip) + sizeof(*udp));
+    if (setsockopt(fd_socket, SOL_UDP, UDP_GRO, &yes, sizeof(yes)) < 0) {
+        DPRINT("UDP_GRO not available on UDP socket: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
 
-        rcv_msg.msg_name = &rcv_addr;
-        rcv_msg.msg_namelen = sizeof(rcv_addr);
-        rcv_msg.msg_iov = &iov;
-        rcv_msg.msg_iovlen = 1;
-        rcv_msg.msg_control = pkt_infos;
-        rcv_msg.msg_controllen = sizeof(pkt_infos);
+/*
+ * sendmmsg() a batch of datagrams without blocking. A datagram that fails is
+ * logged and skipped, and the rest of the batch is still sent. The outcome for
+ * each datagram (0 or an errno value) is stored in `errors`. Returns the number
+ * of datagrams dealt with, which is less than `count` if the interface pushed
+ * back (its queue is full) before the end of the batch.
+ */
+static unsigned int send_batch(int fd_socket, struct mmsghdr *msgs,
+                               unsigned int count, int *errors) {
+    unsigned int sent = 0;
+    int ret;
 
-        rcv_msg_len = recvmsg(fd_udp_socket, &rcv_msg, 0);
-        if (rcv_msg_len <= 0) {
-            DPRINT("recvmsg() returned %d, ignoring this packet\n", (int) rcv_msg_len);
-            continue;    /* ignore broken packets */
+    while (sent < count) {
+        ret = sendmmsg(fd_socket, msgs + sent, count - sent, MSG_DONTWAIT);
+        if (ret < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS)) {
+                break;
+            }
+            EPRINT("Failed to transmit: %s\n", strerror(errno));
+            errors[sent++] = errno;
+        } else {
+            memset(errors + sent, 0, ret * sizeof(*errors));
+            sent += ret;
+        }
+    }
+    return sent;
+}
+
+/* Write a pcapng option at `ptr`, returning the position after it */
+static unsigned char *pcapng_opt(unsigned char *ptr, uint16_t code,
+                                 void const *data, size_t len) {
+    uint16_t hdr[2];
+
+    hdr[0] = code;
+    hdr[1] = (uint16_t) len;
+    memcpy(ptr, hdr, sizeof(hdr));
+    memcpy(ptr + sizeof(hdr), data, len);
+    memset(ptr + sizeof(hdr) + len, 0, PCAPNG_ALIGN(len) - len);
+    return ptr + sizeof(hdr) + PCAPNG_ALIGN(len);
+}
+
+/* Write the type and both length fields of a pcapng block at `ptr` */
+static void pcapng_block(unsigned char *ptr, uint32_t type, size_t len) {
+    uint32_t v;
+
+    memcpy(ptr, &type, sizeof(type));
+    v = (uint32_t) len;
+    memcpy(ptr + 4, &v, sizeof(v));
+    memcpy(ptr + len - 4, &v, sizeof(v));
+}
+
+/*
+ * Create and map the capture file, and write the section header and one
+ * interface description for each side. Returns 0 on error.
+ */
+static int capture_open(void) {
+    int fd, i;
+    size_t size, len;
+    unsigned char *ptr;
+    uint32_t u32;
+    uint16_t u16[2];
+    uint64_t u64;
+    unsigned char tsresol = 9; /* nanoseconds */
+    char name[IF_NAMESIZE + 8];
+    char *old_path;
+
+    size = (size_t) (capture_mb_ ? capture_mb_ : CAPTURE_DEFAULT_MB) << 20;
+
+    /* Always start a new file rather than truncating the old one, which may
+       still be mapped by the relay we are taking over from. The old one is
+       kept as <file>.old, where that relay goes on recording until it exits */
+    old_path = malloc(strlen(capture_path_) + sizeof(".old"));
+    if (!old_path) {
+        EPRINT("Failed to allocate memory: %s\n", strerror(errno));
+        return 0;
+    }
+    strcpy(old_path, capture_path_);
+    strcat(old_path, ".old");
+    if ((rename(capture_path_, old_path) < 0) && (errno != ENOENT)) {
+        EPRINT("Failed to rename %s to %s: %s\n", capture_path_, old_path,
+               strerror(errno));
+        free(old_path);
+        return 0;
+    }
+    free(old_path);
+    fd = open(capture_path_, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+    if (fd < 0) {
+        EPRINT("Failed to create %s: %s\n", capture_path_, strerror(errno));
+        return 0;
+    }
+    if (ftruncate(fd, size) < 0) {
+        EPRINT("Failed to size %s: %s\n", capture_path_, strerror(errno));
+        close(fd);
+        return 0;
+    }
+    capture_.map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (capture_.map == MAP_FAILED) {
+        capture_.map = 0;
+        EPRINT("Failed to map %s: %s\n", capture_path_, strerror(errno));
+        return 0;
+    }
+
+    /* Section header block, with no options */
+    ptr = capture_.map;
+    len = 28;
+    pcapng_block(ptr, PCAPNG_SHB, len);
+    u32 = 0x1a2b3c4d; /* byte order magic */
+    memcpy(ptr + 8, &u32, sizeof(u32));
+    u16[0] = 1; /* version 1.0 */
+    u16[1] = 0;
+    memcpy(ptr + 12, u16, sizeof(u16));
+    u64 = (uint64_t) -1; /* section length not specified */
+    memcpy(ptr + 16, &u64, sizeof(u64));
+    ptr += len;
+
+    /* Interface description blocks; the interface ID is the index in ifs_[] */
+    for (i = 0; i < (int) nifs_; i++) {
+        unsigned char *opt;
+
+        if (trunk_if_name_) {
+            snprintf(name, sizeof(name), "%s.%u", trunk_if_name_,
+                     (unsigned) ifs_[i].vlan_id);
+        } else if (!if_indextoname(ifs_[i].ifindex, name)) {
+            strcpy(name, "<???>");
+        }
+
+        u16[0] = LINKTYPE_IPV4;
+        u16[1] = 0;
+        memcpy(ptr + 8, u16, sizeof(u16));
+        u32 = CAPTURE_SNAPLEN;
+        memcpy(ptr + 12, &u32, sizeof(u32));
+        opt = pcapng_opt(ptr + 16, PCAPNG_OPT_IF_NAME, name, strlen(name));
+        opt = pcapng_opt(opt, PCAPNG_OPT_IF_TSRESOL, &tsresol, 1);
+        opt = pcapng_opt(opt, 0, "", 0);
+        len = opt + 4 - ptr;
+        pcapng_block(ptr, PCAPNG_IDB, len);
+        ptr += len;
+    }
+
+    /* The ring starts out as a single padding block */
+    capture_.ring_start = ptr - capture_.map;
+    capture_.ring_end = size;
+    capture_.head = capture_.ring_start;
+    pcapng_block(ptr, PCAPNG_PAD, size - capture_.ring_start);
+
+    printf("Capturing to %s (%lu MB)\n", capture_path_, (unsigned long) (size >> 20));
+    return 1;
+}
+
+/*
+ * Make room for a `len` byte block in the capture ring, overwriting the
+ * oldest blocks, and return where to write it.
+ */
+static unsigned char *capture_reserve(size_t len) {
+    size_t end, next;
+    uint32_t block_len;
+
+    /* Wrap around if the block doesn't fit, or would leave less room at the
+       end of the ring than a padding block needs */
+    if ((capture_.head + len != capture_.ring_end) &&
+        (capture_.head + len + PCAPNG_MIN_BLOCK > capture_.ring_end)) {
+        if (capture_.head != capture_.ring_end) {
+            pcapng_block(capture_.map + capture_.head, PCAPNG_PAD,
+                         capture_.ring_end - capture_.head);
+        }
+        capture_.head = capture_.ring_start;
+    }
+
+    /* Skip over the blocks being overwritten, until what is left of the last
+       one is either nothing or enough for a padding block. `head` is always
+       at a block boundary */
+    end = capture_.head + len;
+    next = capture_.head;
+    while ((next != end) && (next != capture_.ring_end) &&
+           (next < end + PCAPNG_MIN_BLOCK)) {
+        memcpy(&block_len, capture_.map + next + 4, sizeof(block_len));
+        next += block_len;
+    }
+    if (next != end) {
+        pcapng_block(capture_.map + end, PCAPNG_PAD, next - end);
+    }
+
+    next = capture_.head;
+    capture_.head = end;
+    return capture_.map + next;
+}
+
+/*
+ * Record a packet in the capture ring, as an enhanced packet block on the
+ * interface `iface` with the direction and a comment describing what was done
+ * with it. The packet is `hdr` (its IP and UDP headers) followed by `payload`.
+ */
+static void capture_packet(struct Iface const *iface, uint32_t direction,
+                           void const *hdr, size_t hdr_len,
+                           void const *payload, size_t payload_len,
+                           char const *comment) {
+    size_t orig_len = hdr_len + payload_len;
+    size_t cap_len = (orig_len < CAPTURE_SNAPLEN) ? orig_len : CAPTURE_SNAPLEN;
+    size_t comment_len = strlen(comment);
+    size_t len;
+    unsigned char *ptr, *opt;
+    uint32_t fields[5];
+    uint64_t ns;
+    struct timespec ts;
+    struct iphdr *ip;
+
+    /* type, length, interface ID, timestamp, captured and original lengths,
+       the data, flags and comment options, end of options, length */
+    len = 28 + PCAPNG_ALIGN(cap_len) + 8 + 4 + PCAPNG_ALIGN(comment_len) + 4 + 4;
+    ptr = capture_reserve(len);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ns = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    fields[0] = (uint32_t) (iface - ifs_);
+    fields[1] = (uint32_t) (ns >> 32);
+    fields[2] = (uint32_t) ns;
+    fields[3] = (uint32_t) cap_len;
+    fields[4] = (uint32_t) orig_len;
+    memcpy(ptr + 8, fields, sizeof(fields));
+
+    memcpy(ptr + 28, hdr, (hdr_len < cap_len) ? hdr_len : cap_len);
+    if (cap_len > hdr_len) {
+        memcpy(ptr + 28 + hdr_len, payload, cap_len - hdr_len);
+    }
+    memset(ptr + 28 + cap_len, 0, PCAPNG_ALIGN(cap_len) - cap_len);
+
+    /* The kernel fills in the total length of the packets we send; do the
+       same here so that the capture makes sense */
+    ip = (struct iphdr *) (ptr + 28);
+    if ((cap_len >= sizeof(*ip)) && (ip->tot_len == 0)) {
+        ip->tot_len = htons((unsigned short) orig_len);
+    }
+
+    opt = pcapng_opt(ptr + 28 + PCAPNG_ALIGN(cap_len), PCAPNG_OPT_EPB_FLAGS,
+                     &direction, sizeof(direction));
+    opt = pcapng_opt(opt, PCAPNG_OPT_COMMENT, comment, comment_len);
+    opt = pcapng_opt(opt, 0, "", 0);
+    pcapng_block(ptr, PCAPNG_EPB, len);
+}
+
+/*
+ * Have the pages of the packet buffer arena, none of which has been touched
+ * yet, allocated on the NUMA node of the CPU we are running on, whichever
+ * thread first touches them. The node is preferred rather than required, so
+ * that running short of (huge) pages there does not make page faults fail.
+ * The relay is not pinned to that node, but that is where it starts out.
+ */
+static void pools_bind_node(void) {
+    unsigned long mask[POOL_MAX_NODES / (8 * sizeof(unsigned long))];
+    unsigned int cpu, node, bits = 8 * sizeof(unsigned long);
+
+    pools_.node = -1;
+    if (syscall(__NR_getcpu, &cpu, &node, 0) < 0) {
+        DPRINT("getcpu() failed: %s\n", strerror(errno));
+        return;
+    }
+    if (node >= POOL_MAX_NODES) {
+        return;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[node / bits] |= 1ul << (node % bits);
+    /* The kernel reads one bit less than `maxnode` */
+    if (syscall(__NR_mbind, pools_.arena, pools_.arena_len, MPOL_PREFERRED, mask,
+                POOL_MAX_NODES + 1, 0) < 0) {
+        DPRINT("Failed to bind the packet buffers to node %u: %s\n", node,
+               strerror(errno));
+        return;
+    }
+    pools_.node = (int) node;
+}
+
+/*
+ * Allocate the packet buffer arena, and divide it into `nrx` receive buffers
+ * of `rx_len` bytes and `ntx` egress queue slots of `tx_len` bytes.
+ */
+static int pools_init(size_t rx_len, unsigned int nrx, size_t tx_len,
+                      unsigned int ntx) {
+    struct PktPool *pools[2];
+    unsigned char *ptr;
+    unsigned int i, k;
+    size_t len;
+
+    pools[0] = &(pools_.rx);
+    pools[1] = &(pools_.tx);
+    pools_.rx.slot_len = POOL_ALIGN_UP(rx_len, POOL_ALIGN);
+    pools_.rx.nslots = nrx;
+    pools_.tx.slot_len = POOL_ALIGN_UP(tx_len, POOL_ALIGN);
+    pools_.tx.nslots = ntx;
+    len = 0;
+    for (i = 0; i < 2; i++) {
+        /* The slots, then the free list and the reference counts */
+        len += pools[i]->slot_len * pools[i]->nslots +
+               POOL_ALIGN_UP(2 * pools[i]->nslots * sizeof(unsigned int), POOL_ALIGN);
+    }
+    pools_.arena_len = POOL_ALIGN_UP(len, POOL_HUGEPAGE);
+
+    /* Huge pages are mapped shared, so that fork() does not need spare ones
+       for copy on write */
+    pools_.arena = mmap(0, pools_.arena_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    pools_.hugepages = (pools_.arena != MAP_FAILED);
+    if (!pools_.hugepages) {
+        DPRINT("No huge pages for the packet buffers: %s\n", strerror(errno));
+        pools_.arena = mmap(0, pools_.arena_len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pools_.arena == MAP_FAILED) {
+            EPRINT("Failed to allocate %zu bytes of packet buffers: %s\n",
+                   pools_.arena_len, strerror(errno));
+            return 0;
+        }
+        madvise(pools_.arena, pools_.arena_len, MADV_HUGEPAGE);
+    }
+    pools_bind_node();
+    DPRINT("Packet buffers: %zu bytes in %s pages on node %d, %u x %zu received, "
+           "%u x %zu queued\n", pools_.arena_len, pools_.hugepages ? "huge" : "normal",
+           pools_.node, nrx, pools_.rx.slot_len, ntx, pools_.tx.slot_len);
+
+    ptr = pools_.arena;
+    for (i = 0; i < 2; i++) {
+        pools[i]->slots = ptr;
+        ptr += pools[i]->slot_len * pools[i]->nslots;
+        pools[i]->free = (unsigned int *) ptr;
+        pools[i]->refs = pools[i]->free + pools[i]->nslots;
+        ptr += POOL_ALIGN_UP(2 * pools[i]->nslots * sizeof(unsigned int), POOL_ALIGN);
+        /* Hand out the first slots first, so that only as many pages as
+           needed are ever touched */
+        for (k = 0; k < pools[i]->nslots; k++) {
+            pools[i]->free[k] = pools[i]->nslots - 1 - k;
+        }
+        pools[i]->nfree = pools[i]->nslots;
+    }
+    return 1;
+}
+
+/* Take a free slot of `pool`, with one reference to it, or return -1 */
+static int pool_get(struct PktPool *pool) {
+    unsigned int slot;
+
+    if (pool->nfree == 0) {
+        pool->exhausted++;
+        return -1;
+    }
+    slot = pool->free[--pool->nfree];
+    pool->refs[slot] = 1;
+    return (int) slot;
+}
+
+/* Drop a reference to a slot of `pool`, and free it after the last one */
+static void pool_put(struct PktPool *pool, unsigned int slot) {
+    if (--pool->refs[slot] == 0) {
+        pool->free[pool->nfree++] = slot;
+    }
+}
+
+/* The buffer of a slot of `pool` */
+static unsigned char *pool_slot(struct PktPool const *pool, unsigned int slot) {
+    return pool->slots + slot * pool->slot_len;
+}
+
+/*
+ * Record a datagram received on `iface` in the capture ring, with the
+ * reconstructed headers `hdr`, whose UDP length is set here. A GRO-coalesced
+ * buffer is recorded as the datagrams of `gso_size` bytes (the last one may
+ * be shorter) it stands for. A truncated datagram is recorded with as much of
+ * its payload as fits in an IP packet.
+ */
+static void capture_received(struct Iface const *iface, struct PktHdr *hdr,
+                             unsigned char const *payload, size_t len,
+                             int gso_size, char const *comment) {
+    size_t const max_len = 0xffff - sizeof(*hdr);
+    size_t seg_len, n, cap;
+
+    seg_len = ((gso_size > 0) && ((size_t) gso_size < len)) ? (size_t) gso_size : len;
+    for (; len > 0; payload += n, len -= n) {
+        n = (len < seg_len) ? len : seg_len;
+        cap = (n < max_len) ? n : max_len;
+        hdr->udp.len = htons((unsigned short) (cap + sizeof(hdr->udp)));
+        capture_packet(iface, CAPTURE_IN, hdr, sizeof(*hdr), payload, cap, comment);
+    }
+}
+
+/* Allocate the egress queues of both interfaces; their packets are kept in
+   the packet buffers */
+static int sched_init(void) {
+    unsigned int i, c;
+    struct TxQueue *q;
+
+    for (i = 0; i < MAXIFS; i++) {
+        for (c = 0; c < SCHED_CLASSES; c++) {
+            q = &(ifs_[i].queues[c]);
+            q->depth = queue_depths_[c];
+            q->pkts = calloc(q->depth, sizeof(*(q->pkts)));
+            if (!q->pkts) {
+                EPRINT("Failed to allocate %u-datagram egress queue\n", q->depth);
+                return 0;
+            }
+        }
+        ifs_[i].drr_fresh = 1;
+    }
+    return 1;
+}
+
+/* The traffic class of a datagram, from the --class rules */
+static unsigned int sched_classify(unsigned short sport, unsigned char tos) {
+    unsigned int i;
+
+    for (i = 0; i < nclass_rules_; i++) {
+        if (((class_rules_[i].match == MATCH_SPORT) &&
+             (class_rules_[i].value == sport)) ||
+            ((class_rules_[i].match == MATCH_DSCP) &&
+             (class_rules_[i].value == (unsigned int) (tos >> 2)))) {
+            return class_rules_[i].cls;
+        }
+    }
+    return SCHED_CLASSES - 1;
+}
+
+/* Remove the datagram at the head of a queue (all of its fragments) */
+static void sched_drop_head(struct Iface *iface, unsigned int cls) {
+    struct TxQueue *q = &(iface->queues[cls]);
+    struct QueuedPkt *pkt;
+    char comment[64];
+
+    do {
+        pkt = &(q->pkts[q->head]);
+        if (capture_.map) {
+            snprintf(comment, sizeof(comment), "class %u queue full, dropped", cls);
+            capture_packet(iface, CAPTURE_OUT, &(pkt->hdr), pkt->hdr_len,
+                           pkt->payload, pkt->len, comment);
+        }
+        USDT(drop, iface->ifindex, pkt->hdr.ip.saddr, pkt->hdr.ip.ttl, pkt->len,
+             USDT_DROP_HEAD, pkt->payload);
+        pool_put(pkt->pool, pkt->slot);
+        q->head = (q->head + 1) % q->depth;
+        q->count--;
+        q->dropped++;
+        iface->queued--;
+        sched_queued_--;
+    } while (q->count && (q->pkts[q->head].cost == 0));
+}
+
+/*
+ * Append a packet to a queue, which must have room for it. The packet refers
+ * to `payload` in receive buffer `rx_slot`, or, if that is -1, to a copy in a
+ * queue slot, of which there must be a free one.
+ */
+static void sched_push(struct Iface *iface, unsigned int cls,
+                       struct iphdr const *ip, struct udphdr const *udp,
+                       unsigned char *payload, size_t len, size_t cost,
+                       int rx_slot) {
+    struct TxQueue *q = &(iface->queues[cls]);
+    struct QueuedPkt *pkt;
+
+    pkt = &(q->pkts[(q->head + q->count) % q->depth]);
+    pkt->hdr.ip = *ip;
+    if (udp) {
+        pkt->hdr.udp = *udp;
+        pkt->hdr_len = sizeof(pkt->hdr);
+    } else {
+        pkt->hdr_len = sizeof(pkt->hdr.ip);
+    }
+    if (rx_slot >= 0) {
+        pkt->pool = &(pools_.rx);
+        pkt->slot = (unsigned int) rx_slot;
+        pkt->pool->refs[rx_slot]++;
+        pkt->payload = payload;
+    } else {
+        pkt->pool = &(pools_.tx);
+        pkt->slot = (unsigned int) pool_get(pkt->pool);
+        pkt->payload = pool_slot(pkt->pool, pkt->slot);
+        memcpy(pkt->payload, payload, len);
+    }
+    pkt->len = len;
+    pkt->cost = cost;
+    USDT(enqueue, iface->ifindex, cls, pkt->payload, len);
+    q->count++;
+    q->queued++;
+    iface->queued++;
+    sched_queued_++;
+}
+
+/*
+ * The number of packets a datagram of `len` bytes (without headers) is sent
+ * as on `iface`: 1, or its number of IP fragments, each but the last carrying
+ * `*ptr_frag_len` bytes of the IP payload. Returns 0 if it is too large to
+ * relay in class `cls`.
+ */
+static unsigned int sched_nfrags(struct Iface const *iface, unsigned int cls,
+                                 size_t len, size_t *ptr_frag_len) {
+    size_t frag_len, data_len;
+    unsigned int nfrags;
+
+    *ptr_frag_len = 0;
+    if ((sizeof(struct PktHdr) + len <= (size_t) iface->mtu) &&
+        (len <= queue_slot_len_)) {
+        return 1;
+    }
+
+    /* Each fragment but the last carries a multiple of 8 bytes of the IP
+       payload, i.e. of the UDP header followed by the data */
+    frag_len = iface->mtu - sizeof(struct iphdr);
+    if (frag_len > queue_slot_len_) {
+        frag_len = queue_slot_len_;
+    }
+    frag_len &= ~7u;
+    data_len = sizeof(struct udphdr) + len;
+    nfrags = (frag_len == 0) ? 0 : (data_len + frag_len - 1) / frag_len;
+    if ((nfrags > SCHED_TX_BATCH) || (nfrags > iface->queues[cls].depth)) {
+        return 0;
+    }
+    *ptr_frag_len = frag_len;
+    return nfrags;
+}
+
+/*
+ * Queue a datagram (headers `hdr`, then `payload`) for transmission on `iface`
+ * in class `cls`. A datagram that does not fit in the MTU of `iface` is split
+ * into IP fragments, which are queued together so that they are sent in one
+ * batch. If the queue is full, either the datagram is dropped (and 0 is
+ * returned), or, with --queue-drop head, the oldest datagrams in the queue are
+ * dropped to make room. Returns -1 if the datagram is too large to relay, or
+ * -2 if there are not enough free queue slots to copy it to. The queued
+ * packets refer to `payload` in receive buffer `rx_slot`, or are copied to
+ * queue slots if that is -1.
+ */
+static int sched_enqueue(struct Iface *iface, unsigned int cls,
+                         struct PktHdr const *hdr, unsigned char *payload,
+                         size_t len, int rx_slot) {
+    struct TxQueue *q = &(iface->queues[cls]);
+    struct iphdr ip;
+    size_t frag_len, data_len, offset, chunk;
+    unsigned int nfrags, k;
+
+    nfrags = sched_nfrags(iface, cls, len, &frag_len);
+    if (nfrags == 0) {
+        iface->too_big++;
+        return -1;
+    }
+    data_len = sizeof(hdr->udp) + len;
+
+    if (q->count + nfrags > q->depth) {
+        /* The rest of a datagram whose first fragments have been sent is not
+           dropped, as that would waste those */
+        if (!queue_drop_head_ || (q->pkts[q->head].cost == 0)) {
+            q->dropped += nfrags;
+            return 0;
+        }
+        while (q->count + nfrags > q->depth) {
+            sched_drop_head(iface, cls);
+        }
+    }
+    if ((rx_slot < 0) && (pools_.tx.nfree < nfrags)) {
+        pools_.tx.exhausted++;
+        q->dropped += nfrags;
+        return -2;
+    }
+
+    if (nfrags == 1) {
+        sched_push(iface, cls, &(hdr->ip), &(hdr->udp), payload, len,
+                   sizeof(*hdr) + len, rx_slot);
+        return 1;
+    }
+
+    /* The fragments share an IP ID of our choosing (the kernel would give
+       each one its own) */
+    ip = hdr->ip;
+    if (++frag_id_ == 0) {
+        frag_id_ = 1;
+    }
+    ip.id = htons(frag_id_);
+    for (k = 0, offset = 0; k < nfrags; k++, offset += frag_len) {
+        chunk = (k < nfrags - 1) ? frag_len : data_len - offset;
+        ip.frag_off = htons((offset / 8) | ((k < nfrags - 1) ? IP_MF : 0));
+        if (k == 0) {
+            /* The DRR cost of the whole datagram is charged to its first
+               fragment, so that the scheduler sends the fragments together */
+            sched_push(iface, cls, &ip, &(hdr->udp), payload,
+                       chunk - sizeof(hdr->udp),
+                       (nfrags - 1) * sizeof(ip) + sizeof(*hdr) + len, rx_slot);
+        } else {
+            sched_push(iface, cls, &ip, 0,
+                       payload + offset - sizeof(hdr->udp), chunk, 0, rx_slot);
+        }
+    }
+    iface->fragmented++;
+    return 1;
+}
+
+/* The class the next datagram to transmit on `iface` is taken from, or -1 */
+static int sched_pick(struct Iface *iface) {
+    struct TxQueue *q;
+    unsigned int c;
+
+    if (iface->queued == 0) {
+        return -1;
+    }
+
+    if (sched_ == SCHED_STRICT) {
+        for (c = 0; c < SCHED_CLASSES; c++) {
+            if (iface->queues[c].count) {
+                return c;
+            }
+        }
+    }
+
+    /* Deficit round robin: each class in turn gets a quantum proportional to
+       its weight, and sends while its deficit covers the next datagram */
+    for (;;) {
+        q = &(iface->queues[iface->drr_class]);
+        if (q->count) {
+            if (iface->drr_fresh) {
+                q->deficit += SCHED_QUANTUM * sched_weights_[iface->drr_class];
+                iface->drr_fresh = 0;
+            }
+            if (q->pkts[q->head].cost <= q->deficit) {
+                return iface->drr_class;
+            }
+        } else {
+            q->deficit = 0;
+        }
+        iface->drr_class = (iface->drr_class + 1) % SCHED_CLASSES;
+        iface->drr_fresh = 1;
+    }
+}
+
+/* Look up the MTU of `iface` again, after the kernel refused a packet */
+static void refresh_if_mtu(struct Iface *iface) {
+    char ifname[IF_NAMESIZE + 1];
+    int mtu;
+
+    ifname[IF_NAMESIZE] = '\0';
+    if (!if_indextoname(iface->ifindex, ifname) ||
+        !fetch_if_mtu(iface->raw_socket, ifname, &mtu) || (mtu == iface->mtu)) {
+        return;
+    }
+    IPRINT("MTU of %s changed from %d to %d\n", ifname, iface->mtu, mtu);
+    iface->mtu = mtu;
+}
+
+/*
+ * Transmit the datagrams queued on `iface`, in scheduling order, until the
+ * queues are empty (returns 1) or the interface pushes back (returns 0).
+ */
+static int sched_transmit(struct Iface *iface) {
+    struct sockaddr_in snd_addrs[SCHED_TX_BATCH];
+    struct mmsghdr msgs[SCHED_TX_BATCH];
+    struct iovec iovs[SCHED_TX_BATCH][2];
+    struct QueuedPkt *pkts[SCHED_TX_BATCH];
+    unsigned int classes[SCHED_TX_BATCH];
+    int errors[SCHED_TX_BATCH];
+    unsigned int n, done, i, k, nfrags;
+    struct TxQueue *q;
+    char comment[128];
+    int c, msgsize;
+
+    while (iface->queued) {
+        for (n = 0; (n < SCHED_TX_BATCH) && ((c = sched_pick(iface)) >= 0);) {
+            /* Take the datagram at the head of the class queue: one packet,
+               or all of its fragments */
+            q = &(iface->queues[c]);
+            for (nfrags = 1; (nfrags < q->count) &&
+                 (q->pkts[(q->head + nfrags) % q->depth].cost == 0); nfrags++) {
+            }
+            if (n + nfrags > SCHED_TX_BATCH) {
+                break;
+            }
+            for (k = 0; k < nfrags; k++, n++) {
+                pkts[n] = &(q->pkts[q->head]);
+                classes[n] = c;
+                q->head = (q->head + 1) % q->depth;
+                q->count--;
+                iface->queued--;
+                sched_queued_--;
+                if (sched_ == SCHED_DRR) {
+                    q->deficit = q->count ? q->deficit - pkts[n]->cost : 0;
+                }
+
+                iovs[n][0].iov_base = &(pkts[n]->hdr);
+                iovs[n][0].iov_len = pkts[n]->hdr_len;
+                iovs[n][1].iov_base = pkts[n]->payload;
+                iovs[n][1].iov_len = pkts[n]->len;
+                /* The broadcast address, or a multicast group */
+                memset(&(snd_addrs[n]), 0, sizeof(snd_addrs[n]));
+                snd_addrs[n].sin_family = AF_INET;
+                snd_addrs[n].sin_addr.s_addr = pkts[n]->hdr.ip.daddr;
+                memset(&(msgs[n]), 0, sizeof(msgs[n]));
+                msgs[n].msg_hdr.msg_name = &(snd_addrs[n]);
+                msgs[n].msg_hdr.msg_namelen = sizeof(snd_addrs[n]);
+                msgs[n].msg_hdr.msg_iov = iovs[n];
+                msgs[n].msg_hdr.msg_iovlen = 2;
+            }
+        }
+
+        done = send_batch(iface->raw_socket, msgs, n, errors);
+
+        msgsize = 0;
+        for (i = 0; i < done; i++) {
+            q = &(iface->queues[classes[i]]);
+            if (errors[i]) {
+                q->errors++;
+                msgsize |= (errors[i] == EMSGSIZE);
+                USDT(transmit_error, iface->ifindex, pkts[i]->hdr.ip.daddr,
+                     pkts[i]->len, errors[i], pkts[i]->payload);
+            } else {
+                q->sent++;
+                USDT(transmit, iface->ifindex, pkts[i]->hdr.ip.saddr,
+                     pkts[i]->hdr.ip.daddr, pkts[i]->hdr.ip.ttl, pkts[i]->len,
+                     pkts[i]->payload);
+            }
+            if (capture_.map) {
+                if (errors[i]) {
+                    snprintf(comment, sizeof(comment), "sendto failed: %s",
+                             strerror(errors[i]));
+                } else {
+                    strcpy(comment, "sent");
+                }
+                capture_packet(iface, CAPTURE_OUT, &(pkts[i]->hdr),
+                               pkts[i]->hdr_len, pkts[i]->payload,
+                               pkts[i]->len, comment);
+            }
+            pool_put(pkts[i]->pool, pkts[i]->slot);
+        }
+        if (msgsize) {
+            refresh_if_mtu(iface);
+        }
+
+        if (done < n) {
+            /* Put what was not sent back at the head of its queue. The slots
+               are untouched, as nothing was queued in the meantime */
+            for (i = n; i-- > done;) {
+                q = &(iface->queues[classes[i]]);
+                q->head = (q->head + q->depth - 1) % q->depth;
+                q->count++;
+                iface->queued++;
+                sched_queued_++;
+                if (sched_ == SCHED_DRR) {
+                    q->deficit += pkts[i]->cost;
+                }
+            }
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Transmit what is queued on all interfaces, as far as they let us */
+static void sched_transmit_all(void) {
+    unsigned int i;
+
+    for (i = 0; i < MAXIFS; i++) {
+        sched_transmit(&(ifs_[i]));
+    }
+}
+
+/* Transmit everything still queued before exiting, waiting for the
+   interfaces if need be (but not forever) */
+static void sched_flush(void) {
+    unsigned int waited = 0;
+
+    for (;;) {
+        sched_transmit_all();
+        if ((sched_queued_ == 0) || (waited >= HANDOVER_TIMEOUT_MS)) {
+            break;
+        }
+        poll(0, 0, SCHED_RETRY_MS);
+        waited += SCHED_RETRY_MS;
+    }
+}
+
+static void handle_sigusr1(int signum) {
+    (void) signum;
+    dump_stats_ = 1;
+}
+
+/* The bpf() system call, which the C library does not wrap */
+static int bpf_sys(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* Create a BPF map, returning its fd or -1 */
+static int bpf_create_map(uint32_t type, uint32_t key_size, uint32_t value_size,
+                          uint32_t max_entries, char const *name) {
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+    strncpy(attr.map_name, name, sizeof(attr.map_name) - 1);
+    if ((fd = bpf_sys(BPF_MAP_CREATE, &attr)) < 0) {
+        EPRINT("Failed to create BPF map %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    return fd;
+}
+
+/* Load a BPF program, returning its fd or -1 */
+static int bpf_load_prog(uint32_t type, uint32_t expected_attach_type,
+                         struct bpf_insn const *insns, unsigned int count,
+                         char const *name) {
+    static char log[65536];
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = type;
+    attr.expected_attach_type = expected_attach_type;
+    attr.insns = (uint64_t) (unsigned long) insns;
+    attr.insn_cnt = count;
+    attr.license = (uint64_t) (unsigned long) "GPL";
+    strncpy(attr.prog_name, name, sizeof(attr.prog_name) - 1);
+    if (debug_) {
+        log[0] = '\0';
+        attr.log_buf = (uint64_t) (unsigned long) log;
+        attr.log_size = sizeof(log);
+        attr.log_level = 1;
+    }
+    if ((fd = bpf_sys(BPF_PROG_LOAD, &attr)) < 0) {
+        EPRINT("Failed to load BPF program %s: %s\n", name, strerror(errno));
+        if (debug_) {
+            DPRINT("Verifier log:\n%s\n", log);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/* Attach a BPF program to an interface through a BPF link, which detaches it
+   when we exit. Returns the link fd or -1 */
+static int bpf_attach_link(int prog_fd, unsigned int ifindex,
+                           uint32_t attach_type, uint32_t flags) {
+    union bpf_attr attr;
+    struct BpfLinkCreate link;
+
+    link.prog_fd = prog_fd;
+    link.target_ifindex = ifindex;
+    link.attach_type = attach_type;
+    link.flags = flags;
+    memset(&attr, 0, sizeof(attr));
+    memcpy(&attr, &link, sizeof(link));
+    return bpf_sys(LINK_CREATE_CMD, &attr);
+}
+
+/* Set `key` to `value` in a BPF map */
+static int bpf_update_elem(int map_fd, void const *key, void const *value) {
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t) (unsigned long) key;
+    attr.value = (uint64_t) (unsigned long) value;
+    if (bpf_sys(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        EPRINT("Failed to update BPF map: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+/* Read the value of `key` in a BPF map */
+static int bpf_lookup_elem(int map_fd, void const *key, void *value) {
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t) (unsigned long) key;
+    attr.value = (uint64_t) (unsigned long) value;
+    if (bpf_sys(BPF_MAP_LOOKUP_ELEM, &attr) < 0) {
+        EPRINT("Failed to read BPF map: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+/* The number of receive queues of an interface (1 if the driver won't say) */
+static unsigned int fetch_if_queues(int fd_socket, char const *if_name) {
+    struct ethtool_channels channels;
+    struct ifreq req;
+    unsigned int count;
+
+    memset(&req, 0, sizeof(req));
+    memcpy(req.ifr_name, if_name, strnlen(if_name, IFNAMSIZ - 1));
+    memset(&channels, 0, sizeof(channels));
+    channels.cmd = ETHTOOL_GCHANNELS;
+    req.ifr_data = (void *) &channels;
+    if (ioctl(fd_socket, SIOCETHTOOL, &req) < 0) {
+        return 1;
+    }
+    count = (channels.combined_count > channels.rx_count) ?
+        channels.combined_count : channels.rx_count;
+    return (count == 0) ? 1 : count;
+}
+
+#define EBPF_INSN(code, dst, src, off, imm) { (code), (dst), (src), (off), (imm) }
+
+/*
+ * Load the XDP program for interface `i`, which redirects unfragmented IPv4/UDP
+ * frames (without IP options) for our port to the AF_XDP socket of the queue
+ * they arrived on, and passes everything else to the stack.
+ */
+static int xsk_load_program(unsigned int i) {
+    enum { PASS = 22 };
+    struct bpf_insn prog[] = {
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 1, 0, 0),          /* data */
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 3, 1, 4, 0),          /* data_end */
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0,
+                  ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr)),
+        EBPF_INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 3, PASS - 5, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 12, 0),         /* ethertype */
+        EBPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, PASS - 7, htons(ETH_P_IP)),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_B, 4, 2, ETH_HLEN, 0),   /* version, ihl */
+        EBPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, PASS - 9, 0x45),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_B, 4, 2, ETH_HLEN + 9, 0), /* protocol */
+        EBPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, PASS - 11, 17),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 2, ETH_HLEN + 6, 0), /* frag_off */
+        EBPF_INSN(BPF_ALU64 | BPF_AND | BPF_K, 4, 0, 0, htons(0x3fff)),
+        EBPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, PASS - 14, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 2, ETH_HLEN + 22, 0), /* dport */
+        EBPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, PASS - 16, htons(udport_)),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 1, 16, 0),         /* rx_queue_index */
+        EBPF_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, xsk_.map_fd[i]),
+        EBPF_INSN(0, 0, 0, 0, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS), /* if no socket */
+        EBPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        EBPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        /* PASS: */
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),
+        EBPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    xsk_.prog_fd[i] = bpf_load_prog(BPF_PROG_TYPE_XDP, XDP_ATTACH_TYPE, prog,
+                                    sizeof(prog) / sizeof(prog[0]), "ubrr_xdp");
+    return xsk_.prog_fd[i] != -1;
+}
+
+/* Map one of the rings of an AF_XDP socket */
+static int xsk_map_ring(int fd, struct XskRing *ring,
+                        struct xdp_ring_offset const *off, off_t pgoff,
+                        size_t entry_size) {
+    ring->map_len = off->desc + XSK_RING_SIZE * entry_size;
+    ring->map = mmap(0, ring->map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        EPRINT("Failed to map AF_XDP ring: %s\n", strerror(errno));
+        ring->map = 0;
+        return 0;
+    }
+    ring->producer = (uint32_t *) ((unsigned char *) ring->map + off->producer);
+    ring->consumer = (uint32_t *) ((unsigned char *) ring->map + off->consumer);
+    ring->entries = (unsigned char *) ring->map + off->desc;
+    return 1;
+}
+
+/*
+ * Create the AF_XDP socket for `queue` of `iface`, bound with `bind_flags`.
+ * The first socket registers the UMEM, and the others share it; each has its
+ * own fill and completion rings, as they are bound to different queues.
+ */
+static int xsk_open_socket(struct Iface *iface, unsigned int queue,
+                           uint16_t bind_flags) {
+    struct Xsk *xsk = &(xsk_.socks[xsk_.nsocks]);
+    struct xdp_umem_reg umem_reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp addr;
+    socklen_t optlen = sizeof(off);
+    int size = XSK_RING_SIZE;
+
+    memset(xsk, 0, sizeof(*xsk));
+    xsk->iface = iface;
+    xsk->queue = queue;
+    if ((xsk->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0) {
+        EPRINT("Failed to create AF_XDP socket: %s\n", strerror(errno));
+        return 0;
+    }
+    xsk_.nsocks++;
+
+    if (xsk_.nsocks == 1) {
+        memset(&umem_reg, 0, sizeof(umem_reg));
+        umem_reg.addr = (uint64_t) (unsigned long) xsk_.umem;
+        umem_reg.len = (uint64_t) XSK_NUM_FRAMES * XSK_FRAME_SIZE;
+        umem_reg.chunk_size = XSK_FRAME_SIZE;
+        if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &umem_reg,
+                       sizeof(umem_reg)) < 0) {
+            EPRINT("Failed to register UMEM: %s\n", strerror(errno));
+            return 0;
+        }
+    }
+    if ((setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0) ||
+        (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size,
+                    sizeof(size)) < 0) ||
+        (setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0) ||
+        (setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0) ||
+        (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)) {
+        EPRINT("Failed to set up AF_XDP rings: %s\n", strerror(errno));
+        return 0;
+    }
+    if (!xsk_map_ring(xsk->fd, &(xsk->rx), &(off.rx), XDP_PGOFF_RX_RING,
+                      sizeof(struct xdp_desc)) ||
+        !xsk_map_ring(xsk->fd, &(xsk->tx), &(off.tx), XDP_PGOFF_TX_RING,
+                      sizeof(struct xdp_desc)) ||
+        !xsk_map_ring(xsk->fd, &(xsk->fq), &(off.fr), XDP_UMEM_PGOFF_FILL_RING,
+                      sizeof(uint64_t)) ||
+        !xsk_map_ring(xsk->fd, &(xsk->cq), &(off.cr),
+                      XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t))) {
+        return 0;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = iface->ifindex;
+    addr.sxdp_queue_id = queue;
+    if (xsk_.nsocks == 1) {
+        addr.sxdp_flags = bind_flags;
+    } else {
+        addr.sxdp_flags = XDP_SHARED_UMEM;
+        addr.sxdp_shared_umem_fd = xsk_.socks[0].fd;
+    }
+    if (bind(xsk->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        DPRINT("Failed to bind AF_XDP socket to queue %u: %s\n", queue,
+               strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+/* Undo xsk_try() */
+static void xsk_close(void) {
+    unsigned int i;
+    struct Xsk *xsk;
+
+    for (i = 0; i < MAXIFS; i++) {
+        if (xsk_.link_fd[i] != -1) {
+            close(xsk_.link_fd[i]);
+        }
+        if (xsk_.prog_fd[i] != -1) {
+            close(xsk_.prog_fd[i]);
+        }
+        if (xsk_.map_fd[i] != -1) {
+            close(xsk_.map_fd[i]);
+        }
+        xsk_.link_fd[i] = xsk_.prog_fd[i] = xsk_.map_fd[i] = -1;
+    }
+    for (i = 0; i < xsk_.nsocks; i++) {
+        xsk = &(xsk_.socks[i]);
+        if (xsk->rx.map) {
+            munmap(xsk->rx.map, xsk->rx.map_len);
+        }
+        if (xsk->tx.map) {
+            munmap(xsk->tx.map, xsk->tx.map_len);
+        }
+        if (xsk->fq.map) {
+            munmap(xsk->fq.map, xsk->fq.map_len);
+        }
+        if (xsk->cq.map) {
+            munmap(xsk->cq.map, xsk->cq.map_len);
+        }
+        close(xsk->fd);
+    }
+    xsk_.nsocks = 0;
+}
+
+/*
+ * Try to set up the AF_XDP data path with the XDP program attached with
+ * `attach_flags` (XDP_FLAGS_DRV_MODE or XDP_FLAGS_SKB_MODE) and the sockets
+ * bound with `bind_flags` (XDP_ZEROCOPY or XDP_COPY).
+ */
+static int xsk_try(uint32_t attach_flags, uint16_t bind_flags) {
+    unsigned int i, q, k;
+    int fd;
+
+    for (i = 0; i < MAXIFS; i++) {
+        xsk_.first_sock[i] = xsk_.nsocks;
+        xsk_.map_fd[i] = bpf_create_map(BPF_MAP_TYPE_XSKMAP, sizeof(uint32_t),
+                                        sizeof(int), XSK_MAX_QUEUES, "ubrr_xsks");
+        if ((xsk_.map_fd[i] == -1) || !xsk_load_program(i)) {
+            xsk_close();
+            return 0;
+        }
+        for (q = 0; q < xsk_.nqueues[i]; q++) {
+            if (!xsk_open_socket(&(ifs_[i]), q, bind_flags)) {
+                xsk_close();
+                return 0;
+            }
+            fd = xsk_.socks[xsk_.nsocks - 1].fd;
+            if (!bpf_update_elem(xsk_.map_fd[i], &q, &fd)) {
+                xsk_close();
+                return 0;
+            }
+        }
+    }
+
+    /* Share out the frames: some for each fill ring, the rest for relaying */
+    xsk_.nfree = 0;
+    for (k = 0; k < XSK_NUM_FRAMES; k++) {
+        xsk_.free_frames[xsk_.nfree++] = (uint64_t) k * XSK_FRAME_SIZE;
+    }
+    xsk_.fq_target = XSK_NUM_FRAMES / (2 * xsk_.nsocks);
+    if (xsk_.fq_target > XSK_RING_SIZE) {
+        xsk_.fq_target = XSK_RING_SIZE;
+    }
+
+    for (i = 0; i < MAXIFS; i++) {
+        xsk_.link_fd[i] = bpf_attach_link(xsk_.prog_fd[i], ifs_[i].ifindex,
+                                          XDP_ATTACH_TYPE, attach_flags);
+        if (xsk_.link_fd[i] < 0) {
+            DPRINT("Failed to attach XDP program: %s\n", strerror(errno));
+            xsk_close();
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Give back a frame of the UMEM */
+static void xsk_free_frame(uint64_t addr) {
+    xsk_.free_frames[xsk_.nfree++] = addr & ~((uint64_t) XSK_FRAME_SIZE - 1);
+}
+
+/*
+ * Relay a frame received on `xsk`: rewrite it in place and put it on a TX ring
+ * of the other interface. Returns 0 if the frame is to be freed instead.
+ */
+static int xsk_relay(struct Xsk *xsk, struct xdp_desc const *desc) {
+    unsigned char *frame = xsk_.umem + desc->addr;
+    struct ethhdr *eth = (struct ethhdr *) frame;
+    struct iphdr *ip = (struct iphdr *) (frame + ETH_HLEN);
+    struct udphdr *udp = (struct udphdr *) (ip + 1);
+    struct Iface *rxiface = xsk->iface;
+    struct Iface *txiface = &(ifs_[(rxiface == &(ifs_[IFS_LEFT])) ? IFS_RIGHT : IFS_LEFT]);
+    unsigned int tx = txiface - ifs_;
+    struct Xsk *txxsk;
+    struct xdp_desc *txdesc;
+    size_t ip_len;
+    uint32_t prod;
+
+    rxiface->xsk_received++;
+
+    /* The program has checked the protocol, IP header length, fragment offset
+       and port; make sure the lengths can be trusted */
+    ip_len = ntohs(ip->tot_len);
+    if ((desc->len < ETH_HLEN + sizeof(*ip) + sizeof(*udp)) ||
+        (ip_len > desc->len - ETH_HLEN) || (ip_len < sizeof(*ip) + sizeof(*udp)) ||
+        (ntohs(udp->len) < sizeof(*udp)) || (ntohs(udp->len) > ip_len - sizeof(*ip))) {
+        DPRINT("Malformed IPv4/UDP frame on AF_XDP socket, ignoring it\n");
+        rxiface->xsk_dropped++;
+        return 0;
+    }
+
+    /* Echo check; see the comment in main() */
+    if (((rxiface->srcaddrtype == SRCA_UNCHANGED) && (ip->ttl == echo_marker_ttl_)) ||
+        ((rxiface->srcaddrtype != SRCA_UNCHANGED) &&
+         (ip->saddr == rxiface->srcaddr.s_addr))) {
+        DPRINT("Echo: not forwarding\n");
+        if (capture_.map) {
+            capture_packet(rxiface, CAPTURE_IN, ip, ip_len, 0, 0, "echo dropped");
+        }
+        return 0;
+    }
+    if (ip_len > (size_t) txiface->mtu) {
+        DPRINT("Frame too large for %d-byte MTU, not forwarding\n", txiface->mtu);
+        txiface->too_big++;
+        return 0;
+    }
+    if (capture_.map) {
+        capture_packet(rxiface, CAPTURE_IN, ip, ip_len, 0, 0, "forwarded");
+    }
+
+    memset(eth->h_dest, 0xff, ETH_ALEN);
+    memcpy(eth->h_source, xsk_.hwaddr[tx], ETH_ALEN);
+    rewrite_headers(ip, udp, txiface);
+
+    /* Same queue number on the other side, if it has that many */
+    txxsk = &(xsk_.socks[xsk_.first_sock[tx] + (xsk->queue % xsk_.nqueues[tx])]);
+    prod = *(txxsk->tx.producer);
+    if (prod - __atomic_load_n(txxsk->tx.consumer, __ATOMIC_ACQUIRE) == XSK_RING_SIZE) {
+        DPRINT("AF_XDP TX ring full, not forwarding\n");
+        txiface->xsk_dropped++;
+        return 0;
+    }
+    txdesc = (struct xdp_desc *) txxsk->tx.entries + (prod & (XSK_RING_SIZE - 1));
+    txdesc->addr = desc->addr;
+    txdesc->len = ETH_HLEN + ip_len;
+    txdesc->options = 0;
+    __atomic_store_n(txxsk->tx.producer, prod + 1, __ATOMIC_RELEASE);
+    txxsk->tx_pending++;
+    txiface->xsk_forwarded++;
+    if (capture_.map) {
+        capture_packet(txiface, CAPTURE_OUT, ip, ip_len, 0, 0, "sent");
+    }
+    return 1;
+}
+
+/*
+ * Do a round of AF_XDP work: reclaim transmitted frames, relay received ones,
+ * refill the fill rings and kick transmission. Returns 1 if there is more to
+ * do straight away. Sets `xsk_.waiting` if transmissions have not completed
+ * yet, or a fill ring is running low: completions do not wake poll(), so the
+ * caller must not sleep for long then.
+ */
+static int xsk_process(void) {
+    struct Xsk *xsk;
+    struct xdp_desc *desc;
+    uint64_t *addr;
+    uint32_t prod, cons, n, k;
+    unsigned int i;
+    int busy = 0;
+
+    xsk_.waiting = 0;
+    for (i = 0; i < xsk_.nsocks; i++) {
+        xsk = &(xsk_.socks[i]);
+        cons = *(xsk->cq.consumer);
+        prod = __atomic_load_n(xsk->cq.producer, __ATOMIC_ACQUIRE);
+        for (; cons != prod; cons++) {
+            xsk_free_frame(((uint64_t *) xsk->cq.entries)[cons & (XSK_RING_SIZE - 1)]);
+            xsk->tx_pending--;
+        }
+        __atomic_store_n(xsk->cq.consumer, cons, __ATOMIC_RELEASE);
+    }
+
+    for (i = 0; i < xsk_.nsocks; i++) {
+        xsk = &(xsk_.socks[i]);
+        cons = *(xsk->rx.consumer);
+        prod = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE);
+        n = prod - cons;
+        if (n > XSK_BATCH) {
+            n = XSK_BATCH;
+            busy = 1;
+        }
+        for (k = 0; k < n; k++, cons++) {
+            desc = (struct xdp_desc *) xsk->rx.entries + (cons & (XSK_RING_SIZE - 1));
+            if (!xsk_relay(xsk, desc)) {
+                xsk_free_frame(desc->addr);
+            }
+        }
+        __atomic_store_n(xsk->rx.consumer, cons, __ATOMIC_RELEASE);
+    }
+
+    for (i = 0; i < xsk_.nsocks; i++) {
+        xsk = &(xsk_.socks[i]);
+        prod = *(xsk->fq.producer);
+        cons = __atomic_load_n(xsk->fq.consumer, __ATOMIC_ACQUIRE);
+        for (; (prod - cons < xsk_.fq_target) && xsk_.nfree; prod++) {
+            addr = (uint64_t *) xsk->fq.entries + (prod & (XSK_RING_SIZE - 1));
+            *addr = xsk_.free_frames[--xsk_.nfree];
+        }
+        __atomic_store_n(xsk->fq.producer, prod, __ATOMIC_RELEASE);
+        if (prod - cons < xsk_.fq_target / 2) {
+            xsk_.waiting = 1;
+        }
+
+        if (*(xsk->tx.producer) != __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE)) {
+            if ((sendto(xsk->fd, 0, 0, MSG_DONTWAIT, 0, 0) < 0) &&
+                (errno != EAGAIN) && (errno != EBUSY) && (errno != ENOBUFS)) {
+                EPRINT("Failed to kick AF_XDP transmission: %s\n", strerror(errno));
+            }
+            /* Generic XDP only sends so much per kick */
+            if (*(xsk->tx.producer) != __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE)) {
+                busy = 1;
+            }
+        }
+        if (xsk->tx_pending) {
+            xsk_.waiting = 1;
+        }
+    }
+    return busy;
+}
+
+/* Set up the AF_XDP data path, in the best mode available */
+static int xsk_setup(int fd_socket) {
+    static struct {
+        int mode;
+        uint32_t attach_flags;
+        uint16_t bind_flags;
+        char const *desc;
+    } const attempts[] = {
+        { XSK_MODE_NATIVE, XDP_FLAGS_DRV_MODE, XDP_ZEROCOPY, "native mode, zero-copy" },
+        { XSK_MODE_NATIVE, XDP_FLAGS_DRV_MODE, XDP_COPY, "native mode, copy" },
+        { XSK_MODE_SKB, XDP_FLAGS_SKB_MODE, XDP_COPY, "skb mode, copy" },
+    };
+    char ifname[IF_NAMESIZE + 1];
+    unsigned int i;
+
+    /* Shared, so that it stays the memory the kernel uses if we fork */
+    xsk_.umem = mmap(0, (size_t) XSK_NUM_FRAMES * XSK_FRAME_SIZE,
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (xsk_.umem == MAP_FAILED) {
+        EPRINT("Failed to allocate UMEM: %s\n", strerror(errno));
+        return 0;
+    }
+
+    for (i = 0; i < MAXIFS; i++) {
+        ifname[IF_NAMESIZE] = '\0';
+        if (!if_indextoname(ifs_[i].ifindex, ifname) ||
+            !fetch_if_hwaddr(fd_socket, ifname, xsk_.hwaddr[i])) {
+            return 0;
+        }
+        xsk_.nqueues[i] = fetch_if_queues(fd_socket, ifname);
+        if (xsk_.nqueues[i] > XSK_MAX_QUEUES) {
+            EPRINT("%s has %u queues, only the first %d are used for AF_XDP\n",
+                   ifname, xsk_.nqueues[i], XSK_MAX_QUEUES);
+            xsk_.nqueues[i] = XSK_MAX_QUEUES;
+        }
+        xsk_.link_fd[i] = xsk_.prog_fd[i] = xsk_.map_fd[i] = -1;
+    }
+
+    for (i = 0; i < sizeof(attempts) / sizeof(attempts[0]); i++) {
+        if ((xsk_mode_ != XSK_MODE_AUTO) && (xsk_mode_ != attempts[i].mode)) {
+            continue;
+        }
+        if (xsk_try(attempts[i].attach_flags, attempts[i].bind_flags)) {
+            xsk_process(); /* fill the fill rings */
+            printf("AF_XDP: %u+%u queues, %s\n", xsk_.nqueues[IFS_LEFT],
+                   xsk_.nqueues[IFS_RIGHT], attempts[i].desc);
+            return 1;
+        }
+    }
+    EPRINT("Failed to set up AF_XDP (see --debug for details)\n");
+    return 0;
+}
+
+/* Six instructions calling the checksum helper `func` to account for a header
+   field changing from the value saved at `old_slot` to the one at `new_slot`
+   (both on the stack) */
+#define TC_CSUM_CALL(func, offset, old_slot, new_slot, flags) \
+    EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 1, 6, 0, 0), \
+    EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 2, 0, 0, (offset)), \
+    EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 3, 10, (old_slot), 0), \
+    EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 10, (new_slot), 0), \
+    EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 5, 0, 0, (flags)), \
+    EBPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, (func))
+
+/*
+ * Load the tc program for interface `i`. It relays unfragmented IPv4/UDP
+ * frames (without IP options) for our port as told by entry `i` of the config
+ * map, counts them in entry `i` of the stats map, and drops the original.
+ * r6 is the skb, r7 the config, r8 the stats and r9 the IP total length.
+ */
+static int tc_load_program(unsigned int i) {
+    enum { FAIL = 144, ECHO = 148, PUNT = 152, PASS = 154 };
+    int const data = offsetof(struct __sk_buff, data);
+    int const data_end = offsetof(struct __sk_buff, data_end);
+    struct bpf_insn prog[] = {
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 6, data, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 3, 6, data_end, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0,
+                  ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr)),
+        EBPF_INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 3, PASS - 6, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 12, 0),         /* ethertype */
+        EBPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, PASS - 8, htons(ETH_P_IP)),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_B, 4, 2, ETH_HLEN, 0),   /* version, ihl */
+        EBPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, PASS - 10, 0x45),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_B, 4, 2, ETH_HLEN + 9, 0), /* protocol */
+        EBPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, PASS - 12, 17),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 2, ETH_HLEN + 6, 0), /* frag_off */
+        EBPF_INSN(BPF_ALU64 | BPF_AND | BPF_K, 4, 0, 0, htons(0x3fff)),
+        EBPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, PASS - 15, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 2, ETH_HLEN + 22, 0), /* dport */
+        EBPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, PASS - 17, htons(udport_)),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 6, offsetof(struct __sk_buff, pkt_type), 0),
+        EBPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, PASS - 19, PACKET_OTHERHOST),
+        /* Look up our entries in the maps */
+        EBPF_INSN(BPF_ST | BPF_MEM | BPF_W, 10, 0, -4, i),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -4),
+        EBPF_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, tc_.stats_fd),
+        EBPF_INSN(0, 0, 0, 0, 0),
+        EBPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        EBPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, PASS - 26, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 8, 0, 0, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -4),
+        EBPF_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, tc_.config_fd),
+        EBPF_INSN(0, 0, 0, 0, 0),
+        EBPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        EBPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, PUNT - 33, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 7, 0, 0, 0),
+        /* Echo check; see the comment in main(). Helper calls invalidate the
+           packet pointers, so check the bounds again */
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 6, data, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 3, 6, data_end, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0,
+                  ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr)),
+        EBPF_INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 3, PUNT - 39, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 9, 2, ETH_HLEN + 2, 0), /* tot_len */
+        EBPF_INSN(BPF_ALU | BPF_END | BPF_TO_BE, 9, 0, 0, 16),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 7, offsetof(struct TcConfig, echo_saddr), 0),
+        EBPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 3, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 5, 2, ETH_HLEN + 12, 0), /* saddr */
+        EBPF_INSN(BPF_JMP | BPF_JEQ | BPF_X, 5, 4, ECHO - 45, 0),
+        EBPF_INSN(BPF_JMP | BPF_JA, 0, 0, 3, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_B, 4, 7, offsetof(struct TcConfig, echo_ttl), 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_B, 5, 2, ETH_HLEN + 8, 0), /* ttl */
+        EBPF_INSN(BPF_JMP | BPF_JEQ | BPF_X, 5, 4, ECHO - 49, 0),
+        /* Leave what is too large for the egress MTU to be fragmented */
+        EBPF_INSN(BPF_ST | BPF_MEM | BPF_W, 10, 0, -4, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 1, 6, 0, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 7, offsetof(struct TcConfig, tx_ifindex), 0),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 3, 10, 0, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 3, 0, 0, -4),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 4, 0, 0, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 5, 0, 0, 0),
+        EBPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, FUNC_CHECK_MTU),
+        EBPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 0, 0, PUNT - 58, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 6, data, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 3, 6, data_end, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0,
+                  ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr)),
+        EBPF_INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 3, PUNT - 63, 0),
+        /* Save the header fields to be rewritten, rewrite them, and save the
+           new values, for the checksum updates */
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 2, ETH_HLEN, 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_W, 10, 4, -8, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 2, ETH_HLEN + 8, 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_W, 10, 4, -12, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 2, ETH_HLEN + 12, 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_W, 10, 4, -16, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 2, ETH_HLEN + 16, 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_W, 10, 4, -20, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_B, 4, 2, ETH_HLEN + 1, 0), /* tos */
+        EBPF_INSN(BPF_ALU64 | BPF_ADD | BPF_X, 4, 7, 0, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_B, 4, 4, offsetof(struct TcConfig, tos), 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_B, 2, 4, ETH_HLEN + 1, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 7, offsetof(struct TcConfig, ttl_proto), 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_H, 2, 4, ETH_HLEN + 8, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 7, offsetof(struct TcConfig, saddr), 0),
+        EBPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 1, 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_W, 2, 4, ETH_HLEN + 12, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 7, offsetof(struct TcConfig, daddr), 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_W, 2, 4, ETH_HLEN + 16, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 7, offsetof(struct TcConfig, dst_mac), 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_W, 2, 4, 0, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 7, offsetof(struct TcConfig, dst_mac) + 4, 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_H, 2, 4, 4, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 7, offsetof(struct TcConfig, src_mac), 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_W, 2, 4, ETH_ALEN, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 7, offsetof(struct TcConfig, src_mac) + 4, 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_H, 2, 4, ETH_ALEN + 4, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 2, ETH_HLEN, 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_W, 10, 4, -24, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 2, ETH_HLEN + 8, 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_W, 10, 4, -28, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 2, ETH_HLEN + 12, 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_W, 10, 4, -32, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 2, ETH_HLEN + 16, 0),
+        EBPF_INSN(BPF_STX | BPF_MEM | BPF_W, 10, 4, -36, 0),
+        /* IP header checksum, and UDP checksum (the pseudo header) */
+        TC_CSUM_CALL(BPF_FUNC_l3_csum_replace, ETH_HLEN + 10, -8, -24, 2),
+        TC_CSUM_CALL(BPF_FUNC_l3_csum_replace, ETH_HLEN + 10, -12, -28, 2),
+        TC_CSUM_CALL(BPF_FUNC_l3_csum_replace, ETH_HLEN + 10, -16, -32, 4),
+        TC_CSUM_CALL(BPF_FUNC_l3_csum_replace, ETH_HLEN + 10, -20, -36, 4),
+        TC_CSUM_CALL(BPF_FUNC_l4_csum_replace, ETH_HLEN + 26, -16, -32,
+                     BPF_F_PSEUDO_HDR | BPF_F_MARK_MANGLED_0 | 4),
+        TC_CSUM_CALL(BPF_FUNC_l4_csum_replace, ETH_HLEN + 26, -20, -36,
+                     BPF_F_PSEUDO_HDR | BPF_F_MARK_MANGLED_0 | 4),
+        /* Send a copy out of the other interface, and drop the original */
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 1, 6, 0, 0),
+        EBPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 7, offsetof(struct TcConfig, tx_ifindex), 0),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, 0),
+        EBPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_clone_redirect),
+        EBPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 0, 0, FAIL - 139, 0),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 4, 0, 0, 1),
+        EBPF_INSN(BPF_STX | BPF_ATOMIC | BPF_DW, 8, 4, offsetof(struct TcStats, forwarded),
+                  BPF_ADD),
+        EBPF_INSN(BPF_STX | BPF_ATOMIC | BPF_DW, 8, 9, offsetof(struct TcStats, bytes),
+                  BPF_ADD),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, TC_ACT_SHOT),
+        EBPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        /* FAIL: the frame has been rewritten, so it cannot go up either */
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 4, 0, 0, 1),
+        EBPF_INSN(BPF_STX | BPF_ATOMIC | BPF_DW, 8, 4, offsetof(struct TcStats, errors),
+                  BPF_ADD),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, TC_ACT_SHOT),
+        EBPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        /* ECHO: the UDP socket gets it, and drops it too */
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 4, 0, 0, 1),
+        EBPF_INSN(BPF_STX | BPF_ATOMIC | BPF_DW, 8, 4, offsetof(struct TcStats, echoes),
+                  BPF_ADD),
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, TC_ACT_OK),
+        EBPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        /* PUNT: */
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 4, 0, 0, 1),
+        EBPF_INSN(BPF_STX | BPF_ATOMIC | BPF_DW, 8, 4, offsetof(struct TcStats, passed),
+                  BPF_ADD),
+        /* PASS: */
+        EBPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, TC_ACT_OK),
+        EBPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    tc_.prog_fd[i] = bpf_load_prog(BPF_PROG_TYPE_SCHED_CLS, 0, prog,
+                                   sizeof(prog) / sizeof(prog[0]), "ubrr_tc");
+    return tc_.prog_fd[i] != -1;
+}
+
+/* Fill entry `i` of the config map, for frames received on interface `i` */
+static int tc_set_config(int fd_socket, unsigned int i) {
+    struct Iface const *rxiface = &(ifs_[i]);
+    struct Iface const *txiface = &(ifs_[(i == IFS_LEFT) ? IFS_RIGHT : IFS_LEFT]);
+    char ifname[IF_NAMESIZE + 1];
+    struct TcConfig config;
+    unsigned char *word;
+    unsigned int t;
+
+    memset(&config, 0, sizeof(config));
+    config.tx_ifindex = txiface->ifindex;
+    if (rxiface->srcaddrtype == SRCA_UNCHANGED) {
+        config.echo_ttl = echo_marker_ttl_;
+    } else {
+        config.echo_saddr = rxiface->srcaddr.s_addr;
+    }
+    if (txiface->srcaddrtype != SRCA_UNCHANGED) {
+        config.saddr = txiface->srcaddr.s_addr;
+    }
+    config.daddr = txiface->dstaddr.s_addr;
+    memset(config.dst_mac, 0xff, ETH_ALEN);
+    ifname[IF_NAMESIZE] = '\0';
+    if (!if_indextoname(txiface->ifindex, ifname) ||
+        !fetch_if_hwaddr(fd_socket, ifname, config.src_mac)) {
+        return 0;
+    }
+    for (t = 0; t < 256; t++) {
+        config.tos[t] = relay_tos((unsigned char) t);
+    }
+    /* The 16-bit word as it is laid out in the header */
+    word = (unsigned char *) &(config.ttl_proto);
+    word[0] = (echo_marker_ttl_ == 0) ? 64 : (unsigned char) echo_marker_ttl_;
+    word[1] = 17;
+    return bpf_update_elem(tc_.config_fd, &i, &config);
+}
+
+/* Set up the in-kernel fast path on both interfaces */
+static int tc_setup(int fd_socket) {
+    unsigned int i;
+
+    tc_.config_fd = bpf_create_map(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+                                   sizeof(struct TcConfig), MAXIFS, "ubrr_tc_config");
+    tc_.stats_fd = bpf_create_map(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+                                  sizeof(struct TcStats), MAXIFS, "ubrr_tc_stats");
+    if ((tc_.config_fd == -1) || (tc_.stats_fd == -1)) {
+        return 0;
+    }
+    for (i = 0; i < MAXIFS; i++) {
+        if (!tc_set_config(fd_socket, i) || !tc_load_program(i)) {
+            return 0;
+        }
+    }
+    /* The links, and with them the programs, go away when we exit */
+    for (i = 0; i < MAXIFS; i++) {
+        tc_.link_fd[i] = bpf_attach_link(tc_.prog_fd[i], ifs_[i].ifindex,
+                                         TCX_INGRESS, 0);
+        if (tc_.link_fd[i] < 0) {
+            EPRINT("Failed to attach tc program: %s\n", strerror(errno));
+            return 0;
+        }
+    }
+    printf("tc fast path attached\n");
+    return 1;
+}
+
+/* Log the counters of the interfaces and the state of the egress queues */
+static void dump_stats(void) {
+    char ifname[IF_NAMESIZE + 1];
+    struct TxQueue *q;
+    struct TcStats stats;
+    unsigned int i, c;
+
+    for (i = 0; i < nifs_; i++) {
+        ifname[IF_NAMESIZE] = '\0';
+        if (trunk_if_name_) {
+            snprintf(ifname, sizeof(ifname), "vlan %u", ifs_[i].vlan_id);
+        } else if (!if_indextoname(ifs_[i].ifindex, ifname)) {
+            strcpy(ifname, "<???>");
+        }
+        IPRINT("%s: mtu %d, %lu fragmented, %lu truncated, %lu too big\n", ifname,
+               ifs_[i].mtu, ifs_[i].fragmented, ifs_[i].truncated, ifs_[i].too_big);
+        if (xsk_.nsocks) {
+            IPRINT("%s: AF_XDP %lu received, %lu forwarded, %lu dropped\n", ifname,
+                   ifs_[i].xsk_received, ifs_[i].xsk_forwarded, ifs_[i].xsk_dropped);
+        }
+        if (tc_mode_ && bpf_lookup_elem(tc_.stats_fd, &i, &stats)) {
+            IPRINT("%s: tc %llu forwarded (%llu bytes), %llu echoes, %llu passed "
+                   "up, %llu errors\n", ifname, (unsigned long long) stats.forwarded,
+                   (unsigned long long) stats.bytes, (unsigned long long) stats.echoes,
+                   (unsigned long long) stats.passed, (unsigned long long) stats.errors);
+        }
+        for (c = 0; (c < SCHED_CLASSES) && !trunk_if_name_; c++) {
+            q = &(ifs_[i].queues[c]);
+            IPRINT("%s class %u: %u/%u queued, %lu enqueued, %lu sent, "
+                   "%lu dropped, %lu errors\n", ifname, c, q->count, q->depth,
+                   q->queued, q->sent, q->dropped, q->errors);
+        }
+    }
+    IPRINT("packet buffers (%s pages): %u/%u receive buffers free, %lu exhausted, "
+           "%u/%u queue slots free, %lu exhausted\n",
+           pools_.hugepages ? "huge" : "normal", pools_.rx.nfree, pools_.rx.nslots,
+           pools_.rx.exhausted, pools_.tx.nfree, pools_.tx.nslots, pools_.tx.exhausted);
+}
+
+/* Fill in the address of the handover UNIX socket */
+static void handover_addr(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, handover_path_, sizeof(addr->sun_path) - 1);
+}
+
+/*
+ * Connect to a running relay on `handover_path_` and receive its sockets.
+ * Usable sockets are stored in `adopted_udp_socket_` and `adopted_raw_socket_`
+ * and the connection to the old relay is returned in `*ptr_fd_conn` (to be
+ * passed to handover_complete()). If no relay is listening, `*ptr_fd_conn` is
+ * set to -1. Returns 0 on error.
+ */
+static int handover_takeover(int *ptr_fd_conn) {
+    int fd_conn;
+    unsigned int i, j, nfds;
+    struct sockaddr_un addr;
+    struct sockaddr_in bound_addr;
+    socklen_t addrlen;
+    struct HandoverMsg ho;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct timeval tv;
+    int fds[HANDOVER_MAX_FDS];
+    u_char control[CMSG_SPACE(sizeof(fds))];
+    ssize_t len;
+
+    *ptr_fd_conn = -1;
+
+    if ((fd_conn = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0) {
+        EPRINT("Failed to create handover socket: %s\n", strerror(errno));
+        return 0;
+    }
+
+    handover_addr(&addr);
+    if (connect(fd_conn, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        if ((errno == ENOENT) || (errno == ECONNREFUSED)) {
+            /* No relay running; start from scratch */
+            close(fd_conn);
+            return 1;
+        }
+        EPRINT("Failed to connect to %s: %s\n", handover_path_, strerror(errno));
+        close(fd_conn);
+        return 0;
+    }
+
+    tv.tv_sec = HANDOVER_TIMEOUT_MS / 1000;
+    tv.tv_usec = (HANDOVER_TIMEOUT_MS % 1000) * 1000;
+    if (setsockopt(fd_conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        EPRINT("Failed to set SO_RCVTIMEO on handover socket: %s\n",
+               strerror(errno));
+        close(fd_conn);
+        return 0;
+    }
+
+    memset(&ho, 0, sizeof(ho));
+    iov.iov_base = &ho;
+    iov.iov_len = sizeof(ho);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    len = recvmsg(fd_conn, &msg, MSG_CMSG_CLOEXEC);
+    if (len < 0) {
+        EPRINT("Failed to receive sockets from %s: %s\n", handover_path_,
+               strerror(errno));
+        close(fd_conn);
+        return 0;
+    }
+
+    nfds = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
+    }
+
+    if ((len != sizeof(ho)) || (ho.magic != HANDOVER_MAGIC) ||
+        (ho.version != HANDOVER_VERSION) || (ho.nfds != nfds) ||
+        (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        EPRINT("Malformed handover message from %s\n", handover_path_);
+        for (i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        close(fd_conn);
+        return 0;
+    }
+
+    /* Keep the sockets that match our configuration; a successor may well
+       have been started with different interfaces or a different port */
+    for (i = 0; i < nfds; i++) {
+        int adopted = 0;
+
+        if (ho.fds[i].role == HANDOVER_FD_UDP) {
+            addrlen = sizeof(bound_addr);
+            if ((adopted_udp_socket_ == -1) && !trunk_if_name_ &&
+                (getsockname(fds[i], (struct sockaddr *) &bound_addr,
+                             &addrlen) == 0) &&
+                (bound_addr.sin_port == htons(udport_))) {
+                adopted_udp_socket_ = fds[i];
+                adopted = 1;
+            }
+        } else if (ho.fds[i].role == HANDOVER_FD_TRUNK) {
+            if ((adopted_trunk_socket_ == -1) && trunk_if_name_ &&
+                (ho.fds[i].ifindex == trunk_ifindex_)) {
+                adopted_trunk_socket_ = fds[i];
+                adopted = 1;
+            }
+        } else if (ho.fds[i].role == HANDOVER_FD_MCAST) {
+            /* Identified by the group and port it is bound to */
+            addrlen = sizeof(bound_addr);
+            if (getsockname(fds[i], (struct sockaddr *) &bound_addr, &addrlen) == 0) {
+                for (j = 0; j < nmcast_groups_; j++) {
+                    if ((mcast_groups_[j].socket == -1) &&
+                        (mcast_groups_[j].addr.s_addr == bound_addr.sin_addr.s_addr) &&
+                        (htons(mcast_groups_[j].port) == bound_addr.sin_port)) {
+                        mcast_groups_[j].socket = fds[i];
+                        adopted = 1;
+                        break;
+                    }
+                }
+            }
+        } else if ((ho.fds[i].role == HANDOVER_FD_RAW) && !trunk_if_name_) {
+            for (j = 0; j < MAXIFS; j++) {
+                if ((adopted_raw_socket_[j] == -1) &&
+                    (ho.fds[i].ifindex == ifs_[j].ifindex)) {
+                    adopted_raw_socket_[j] = fds[i];
+                    adopted = 1;
+                    break;
+                }
+            }
+        }
+
+        if (!adopted) {
+            DPRINT("Not adopting handed over socket %u (role %d)\n", i,
+                   ho.fds[i].role);
+            close(fds[i]);
+        }
+    }
+
+    printf("Took over %u socket(s) from the relay on %s\n", nfds, handover_path_);
+    *ptr_fd_conn = fd_conn;
+    return 1;
+}
+
+/*
+ * Tell the old relay (if `fd_conn` is not -1) that we are still setting up.
+ * It waits at most HANDOVER_TIMEOUT_MS for each of these, so that a setup
+ * step that takes long cannot make it give up on us half way. Returns 0 if
+ * the old relay is gone, in which case it carries on without us.
+ */
+static int handover_keepalive(int fd_conn) {
+    char c = 'K';
+
+    if ((fd_conn != -1) && (send(fd_conn, &c, 1, MSG_NOSIGNAL) != 1)) {
+        EPRINT("The old relay stopped waiting for us: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Tell the old relay that we are about to start forwarding, and wait for it
+ * to release the handover socket path. Returns 0 if it did not acknowledge,
+ * in which case it may still be forwarding and we must not.
+ */
+static int handover_complete(int fd_conn) {
+    char c = 'R';
+    ssize_t len;
+
+    if (send(fd_conn, &c, 1, MSG_NOSIGNAL) != 1) {
+        EPRINT("Failed to signal readiness to the old relay: %s\n",
+               strerror(errno));
+        close(fd_conn);
+        return 0;
+    }
+    if ((len = recv(fd_conn, &c, 1, 0)) < 0) {
+        EPRINT("No acknowledgement from the old relay: %s\n", strerror(errno));
+    } else if ((len != 1) || (c != 'D')) {
+        EPRINT("The old relay did not acknowledge the handover\n");
+    }
+    close(fd_conn);
+    return (len == 1) && (c == 'D');
+}
+
+/*
+ * Listen on `handover_path_` for a successor. Returns the listening socket,
+ * or -1 (after logging) if that was not possible.
+ */
+static int handover_listen(void) {
+    int fd_listen;
+    struct sockaddr_un addr;
+
+    if ((fd_listen = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                            0)) < 0) {
+        EPRINT("Failed to create handover socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Any file left at the path is stale: we either took over from its
+       owner or found nobody listening on it */
+    handover_addr(&addr);
+    unlink(addr.sun_path);
+
+    if (bind(fd_listen, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        EPRINT("Failed to bind handover socket to %s: %s\n", handover_path_,
+               strerror(errno));
+        close(fd_listen);
+        return -1;
+    }
+
+    if (listen(fd_listen, 1) < 0) {
+        EPRINT("Failed to listen on %s: %s\n", handover_path_, strerror(errno));
+        close(fd_listen);
+        unlink(addr.sun_path);
+        return -1;
+    }
+
+    return fd_listen;
+}
+
+/*
+ * Hand our sockets over to a successor that connected to `fd_listen`. If the
+ * successor acknowledges, we exit; otherwise we carry on forwarding.
+ * `fd_socket` is the socket the forwarding loop reads from.
+ */
+static void handover_serve(int fd_listen, int fd_socket) {
+    int fd_conn;
+    unsigned int i;
+    struct HandoverMsg ho;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct timeval tv;
+    int fds[HANDOVER_MAX_FDS];
+    u_char control[CMSG_SPACE(sizeof(fds))];
+    ssize_t len;
+    char c;
+
+    if ((fd_conn = accept(fd_listen, 0, 0)) < 0) {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            EPRINT("Failed to accept handover connection: %s\n", strerror(errno));
+        }
+        return;
+    }
+
+    memset(&ho, 0, sizeof(ho));
+    ho.magic = HANDOVER_MAGIC;
+    ho.version = HANDOVER_VERSION;
+    if (trunk_if_name_) {
+        ho.fds[ho.nfds].role = HANDOVER_FD_TRUNK;
+        ho.fds[ho.nfds].ifindex = trunk_ifindex_;
+        fds[ho.nfds++] = fd_socket;
+    } else {
+        ho.fds[ho.nfds].role = HANDOVER_FD_UDP;
+        fds[ho.nfds++] = fd_socket;
+        for (i = 0; i < MAXIFS; i++) {
+            ho.fds[ho.nfds].role = HANDOVER_FD_RAW;
+            ho.fds[ho.nfds].ifindex = ifs_[i].ifindex;
+            fds[ho.nfds++] = ifs_[i].raw_socket;
+        }
+        for (i = 0; i < nmcast_groups_; i++) {
+            ho.fds[ho.nfds].role = HANDOVER_FD_MCAST;
+            fds[ho.nfds++] = mcast_groups_[i].socket;
+        }
+    }
+
+    iov.iov_base = &ho;
+    iov.iov_len = sizeof(ho);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(ho.nfds * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(ho.nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, ho.nfds * sizeof(int));
+
+    if (sendmsg(fd_conn, &msg, MSG_NOSIGNAL) < 0) {
+        EPRINT("Failed to send sockets to successor: %s\n", strerror(errno));
+        close(fd_conn);
+        return;
+    }
+
+    /* The successor shares our sockets from here on, so whatever arrives while
+       we wait simply queues up on the UDP socket for it to read. It sends a
+       'K' before each setup step, and an 'R' when it is ready */
+    tv.tv_sec = HANDOVER_TIMEOUT_MS / 1000;
+    tv.tv_usec = (HANDOVER_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(fd_conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    do {
+        len = recv(fd_conn, &c, 1, 0);
+    } while ((len == 1) && (c == 'K'));
+    if ((len != 1) || (c != 'R')) {
+        EPRINT("Successor did not take over, continuing\n");
+        close(fd_conn);
+        return;
+    }
+
+    /* Release the path so the successor can listen on it, and let it start
+       forwarding straight away: the sockets are shared, so it need not wait
+       for us to send what we have queued before going away */
+    close(fd_listen);
+    unlink(handover_path_);
+    c = 'D';
+    send(fd_conn, &c, 1, MSG_NOSIGNAL);
+    close(fd_conn);
+    if (!trunk_if_name_) {
+        sched_flush();
+    }
+
+    IPRINT("Handed over to successor, exiting\n");
+    closelog();
+    exit(0);
+}
+
+/*
+ * Wait up to `timeout_ms` for `fd_socket` to become readable, serving a
+ * successor if one connects to `fd_listen` (if not -1) in the meantime.
+ * Returns what poll() returned. The multicast group and AF_XDP sockets count
+ * as `fd_socket`.
+ */
+static int handover_poll(int fd_listen, int fd_socket, int timeout_ms) {
+    struct pollfd pfd[2 + MCAST_MAX_GROUPS + MAXIFS * XSK_MAX_QUEUES];
+    unsigned int n = 0, i;
+    int ret;
+
+    pfd[n].fd = fd_socket;
+    pfd[n++].events = POLLIN;
+    for (i = 0; i < nmcast_groups_; i++) {
+        pfd[n].fd = mcast_groups_[i].socket;
+        pfd[n++].events = POLLIN;
+    }
+    for (i = 0; i < xsk_.nsocks; i++) {
+        pfd[n].fd = xsk_.socks[i].fd;
+        pfd[n++].events = POLLIN;
+    }
+    pfd[n].fd = fd_listen;
+    pfd[n].events = POLLIN;
+
+    ret = poll(pfd, (fd_listen == -1) ? n : n + 1, timeout_ms);
+    if ((ret > 0) && (fd_listen != -1) && (pfd[n].revents & POLLIN)) {
+        handover_serve(fd_listen, fd_socket);
+    }
+    return ret;
+}
+
+/*
+ * recvmsg() on the sockets the forwarding loop reads from: `fd_socket` and
+ * the multicast group sockets, taking turns. `*ptr_group` is set to the index
+ * of the group the datagram was sent to, or -1. Blocks if `wait` is set (or
+ * fails with EAGAIN otherwise). If handover is enabled (`fd_listen` != -1), a
+ * successor is served while waiting, and every HANDOVER_POLL_INTERVAL packets
+ * when busy.
+ */
+static ssize_t relay_recvmsg(int fd_socket, struct msghdr *msg, int fd_listen,
+                             int wait, int *ptr_group) {
+    static unsigned int countdown = HANDOVER_POLL_INTERVAL;
+    static unsigned int next = 0;
+    unsigned int k, sock;
+    ssize_t len = -1;
+
+    *ptr_group = -1;
+    if ((fd_listen == -1) && (nmcast_groups_ == 0)) {
+        return recvmsg(fd_socket, msg, wait ? 0 : MSG_DONTWAIT);
+    }
+
+    for (;;) {
+        if ((fd_listen != -1) && (--countdown == 0)) {
+            countdown = HANDOVER_POLL_INTERVAL;
+            handover_poll(fd_listen, fd_socket, 0);
+        }
+        /* Socket 0 is `fd_socket`, and socket k is group k - 1 */
+        for (k = 0; k <= nmcast_groups_; k++) {
+            sock = (next + k) % (nmcast_groups_ + 1);
+            len = recvmsg((sock == 0) ? fd_socket : mcast_groups_[sock - 1].socket,
+                          msg, MSG_DONTWAIT);
+            if ((len >= 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+                next = sock + 1;
+                *ptr_group = (int) sock - 1;
+                return len;
+            }
+        }
+        if (!wait) {
+            return len;
+        }
+        if ((handover_poll(fd_listen, fd_socket, -1) < 0) && (errno == EINTR)) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * The forwarding loop for trunk mode. `buf` must have room for a maximum
+ * sized frame plus one 802.1Q tag.
+ */
+static void trunk_loop(unsigned char *buf, int fd_trunk_socket,
+                       int fd_handover_listen) {
+    char ipstr[INET_ADDRSTRLEN + 1];
+    char comment[128];
+    struct sockaddr_ll snd_addr;
+    unsigned int i;
+
+    memset(&snd_addr, 0, sizeof(snd_addr));
+    snd_addr.sll_family = AF_PACKET;
+    snd_addr.sll_ifindex = trunk_ifindex_;
+    snd_addr.sll_halen = ETH_ALEN;
+    memset(snd_addr.sll_addr, 0xff, ETH_ALEN);
+
+    for (;;) /* endless loop */
+    {
+        struct sockaddr_ll rcv_addr;
+        struct msghdr rcv_msg;
+        struct iovec iov;
+        struct tpacket_auxdata rcv_aux;
+        struct Iface *txiface, *rxiface;
+        struct cmsghdr *cmsg;
+        struct ethhdr *eth;
+        struct iphdr *ip;
+        struct udphdr *udp;
+        unsigned char *frame;
+        unsigned short *vlan; /* TCI, then the encapsulated ethertype */
+        unsigned short tci;
+        in_addr_t rcv_saddr;
+        size_t ip_len, udp_len;
+        int group; /* always -1, as there are no groups in trunk mode */
+        int have_aux = 0;
+
+        ssize_t rcv_msg_len;
+        u_char pkt_infos[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+
+        if (dump_stats_) {
+            dump_stats_ = 0;
+            dump_stats();
+        }
+
+        /* Leave room in front of the frame for inserting the 802.1Q tag, in
+           case it was stripped on receive */
+        frame = buf + VLAN_HLEN;
+        iov.iov_base = frame;
+        iov.iov_len = largest_mtu_ - VLAN_HLEN;
+
+        rcv_msg.msg_name = &rcv_addr;
+        rcv_msg.msg_namelen = sizeof(rcv_addr);
+        rcv_msg.msg_iov = &iov;
+        rcv_msg.msg_iovlen = 1;
+        rcv_msg.msg_control = pkt_infos;
+        rcv_msg.msg_controllen = sizeof(pkt_infos);
+        rcv_msg.msg_flags = 0;
+
+        rcv_msg_len = relay_recvmsg(fd_trunk_socket, &rcv_msg, fd_handover_listen, 1,
+                                    &group);
+        if (rcv_msg_len <= 0) {
+            DPRINT("recvmsg() returned %d, ignoring this frame\n", (int) rcv_msg_len);
+            continue;
+        }
+        if (rcv_addr.sll_pkttype == PACKET_OUTGOING) {
+            continue;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&rcv_msg); cmsg;
+             cmsg = CMSG_NXTHDR(&rcv_msg, cmsg)) {
+            if ((cmsg->cmsg_level == SOL_PACKET) &&
+                (cmsg->cmsg_type == PACKET_AUXDATA)) {
+                memcpy(&rcv_aux, CMSG_DATA(cmsg), sizeof(rcv_aux));
+                have_aux = 1;
+            }
+        }
+
+        /* Find the tag: either in the frame, or in the auxdata, in which case
+           we put it back into the frame so that it can be rewritten below */
+        eth = (struct ethhdr *) frame;
+        if ((size_t) rcv_msg_len < ETH_HLEN + VLAN_HLEN) {
+            continue;
+        }
+        if (eth->h_proto == htons(ETH_P_8021Q)) {
+            vlan = (unsigned short *) (frame + ETH_HLEN);
+            tci = ntohs(vlan[0]);
+        } else if (have_aux && (rcv_aux.tp_status & TP_STATUS_VLAN_VALID)) {
+            tci = rcv_aux.tp_vlan_tci;
+            frame -= VLAN_HLEN;
+            memmove(frame, frame + VLAN_HLEN, 2 * ETH_ALEN);
+            rcv_msg_len += VLAN_HLEN;
+            eth = (struct ethhdr *) frame;
+            eth->h_proto = htons(ETH_P_8021Q);
+            vlan = (unsigned short *) (frame + ETH_HLEN);
+            vlan[0] = htons(tci);
+        } else {
+            DPRINT("Untagged frame, ignoring it\n");
+            continue;
+        }
+
+        if (vlan[1] != htons(ETH_P_IP)) {
+            continue;
+        }
+
+        for (i = 0; i < nifs_; i++) {
+            if ((tci & VLAN_VID_MASK) == ifs_[i].vlan_id) {
+                break;
+            }
+        }
+        if (i == nifs_) {
+            DPRINT("Packet arrived on uninteresting vlan %u\n", tci & VLAN_VID_MASK);
+            continue;
+        }
+        rxiface = &(ifs_[i]);
+
+        if (rcv_msg.msg_flags & MSG_TRUNC) {
+            DPRINT("Frame truncated, ignoring it\n");
+            rxiface->truncated++;
+            continue;
+        }
+
+        /* The filter has checked protocol, fragment offset and port; make sure
+           the lengths can be trusted */
+        ip = (struct iphdr *) (frame + ETH_HLEN + VLAN_HLEN);
+        ip_len = rcv_msg_len - (ETH_HLEN + VLAN_HLEN);
+        if ((ip_len < sizeof(*ip) + sizeof(*udp)) || (ip->version != 4) ||
+            (ip->ihl < 5) || (ntohs(ip->tot_len) > ip_len) ||
+            (ntohs(ip->tot_len) < ip->ihl * 4u + sizeof(*udp))) {
+            DPRINT("Malformed IPv4 header, ignoring this frame\n");
+            continue;
+        }
+        ip_len = ntohs(ip->tot_len); /* drop any Ethernet padding */
+        udp = (struct udphdr *) ((unsigned char *) ip + ip->ihl * 4);
+        udp_len = ntohs(udp->len);
+        if ((udp_len < sizeof(*udp)) || (udp_len > ip_len - ip->ihl * 4) ||
+            (udp->dest != htons(udport_))) {
+            DPRINT("Malformed UDP header, ignoring this frame\n");
+            continue;
+        }
+
+        ipstr[INET_ADDRSTRLEN] = '\0';
+        DPRINT("Received %lu bytes of data from %s:%u on vlan %u\n",
+               (unsigned long) (udp_len - sizeof(*udp)),
+               inet_ntop(AF_INET, &(ip->saddr), ipstr, INET_ADDRSTRLEN),
+               (unsigned int) ntohs(udp->source), tci & VLAN_VID_MASK);
+
+        /* Echo check; see the comment in main() */
+        if (rxiface->srcaddrtype == SRCA_UNCHANGED) {
+            if (ip->ttl == echo_marker_ttl_) {
+                DPRINT("Echo (TTL matches echo marker): not forwarding\n");
+                if (capture_.map) {
+                    capture_packet(rxiface, CAPTURE_IN, ip, ip_len, 0, 0,
+                                   "echo (TTL matches echo marker) dropped");
+                }
+                continue;
+            }
+        } else if (ip->saddr == rxiface->srcaddr.s_addr) {
+            DPRINT("Echo (Source IP address is ours): not forwarding\n");
+            if (capture_.map) {
+                capture_packet(rxiface, CAPTURE_IN, ip, ip_len, 0, 0,
+                               "echo (source address is ours) dropped");
+            }
+            continue;
+        }
+
+        DPRINT("Forwarding\n");
+        if (capture_.map) {
+            capture_packet(rxiface, CAPTURE_IN, ip, ip_len, 0, 0, "forwarded");
+        }
+
+        /* Rewrite the Ethernet header, then the tag (keeping the priority) and
+           the IP/UDP headers for each of the other VLANs in turn */
+        memset(eth->h_dest, 0xff, ETH_ALEN);
+        memcpy(eth->h_source, trunk_mac_, ETH_ALEN);
+        rcv_saddr = ip->saddr;
+
+        for (i = 0; i < nifs_; i++) {
+            txiface = &(ifs_[i]);
+            if (txiface == rxiface) {
+                continue;
+            }
+
+            vlan[0] = htons((tci & ~VLAN_VID_MASK) | txiface->vlan_id);
+            ip->saddr = rcv_saddr; /* in case it is to be left unchanged */
+            rewrite_headers(ip, udp, txiface);
+
+            if (sendto(fd_trunk_socket, frame, ETH_HLEN + VLAN_HLEN + ip_len, 0,
+                       (struct sockaddr *) &snd_addr, sizeof(snd_addr)) < 0) {
+                EPRINT("Failed to transmit: %s\n", strerror(errno));
+                if (capture_.map) {
+                    snprintf(comment, sizeof(comment), "sendto failed: %s",
+                             strerror(errno));
+                    capture_packet(txiface, CAPTURE_OUT, ip, ip_len, 0, 0, comment);
+                }
+            } else if (capture_.map) {
+                capture_packet(txiface, CAPTURE_OUT, ip, ip_len, 0, 0, "sent");
+            }
+        }
+    }
+}
+
+int main(int argc,char **argv) {
+    unsigned int i, j;
+    unsigned char *buf;
+    int rx_slot;
+    char ipstr[INET_ADDRSTRLEN + 1];
+    char ifname[IF_NAMESIZE + 1];
+    char comment[128];
+    int fd_udp_socket = -1;
+    int fd_trunk_socket = -1;
+    int fd_handover_conn = -1;
+    int fd_handover_listen = -1;
+    unsigned int burst = 0;
+    unsigned int queue_slots = 0;
+    int xsk_busy = 0;
+    struct sigaction sa;
+    struct in_addr any_addr;
+    int yes = 1;
+    int no = 0;
+
+    openlog("ubrr", LOG_PID | LOG_CONS, LOG_LOCAL1);
+    if (!parse_command_line(argc, argv)) {
+	closelog();
+        exit(1);
+    }
+    if (debug_ == 0) {
+	setlogmask(LOG_UPTO (LOG_INFO));
+    }
+
+    any_addr.s_addr = INADDR_ANY;
+
+    /* Take over the sockets of a relay that is already running, if any */
+    if (handover_path_ && !handover_takeover(&fd_handover_conn)) {
+        closelog();
+        exit(1);
+    }
+
+    if (trunk_if_name_) {
+        /* A single packet socket both receives and transmits */
+        for (i = 0; i < MAXIFS; i++) {
+            ifs_[i].raw_socket = -1;
+        }
+        if (adopted_trunk_socket_ != -1) {
+            fd_trunk_socket = adopted_trunk_socket_;
+            if (!attach_trunk_filter(fd_trunk_socket)) {
+                closelog();
+                exit(1);
+            }
+        } else if ((fd_trunk_socket = setup_trunk_socket()) == -1) {
+            closelog();
+            exit(1);
+        }
+    } else {
+        for (i = 0; i < MAXIFS; i++) {
+            if (adopted_raw_socket_[i] != -1) {
+                ifs_[i].raw_socket = adopted_raw_socket_[i];
+                /* The old relay may not have relayed multicast */
+                ifname[IF_NAMESIZE] = '\0';
+                if (nmcast_groups_ && if_indextoname(ifs_[i].ifindex, ifname) &&
+                    !setup_raw_mcast(ifs_[i].raw_socket, &(ifs_[i]), ifname)) {
+                    closelog();
+                    exit(1);
+                }
+            } else if (!setup_raw_socket(&(ifs_[i]))) {
+                for (j = 0; j < i; j++) {
+                    close(ifs_[j].raw_socket);
+                }
+                closelog();
+                exit(1);
+            }
+        }
+
+        /* Create our broadcast receiving socket */
+        if (adopted_udp_socket_ != -1) {
+            fd_udp_socket = adopted_udp_socket_;
+            /* In case the old relay did not ask for the TOS, or received
+               multicast on it */
+            setsockopt(fd_udp_socket, SOL_IP, IP_RECVTOS, &yes, sizeof(yes));
+            setsockopt(fd_udp_socket, SOL_IP, IP_MULTICAST_ALL, &no, sizeof(no));
+        } else if ((fd_udp_socket = setup_udp_socket(any_addr, udport_)) == -1) {
+            for (i = 0; i < MAXIFS; i++) {
+                close(ifs_[i].raw_socket);
+            }
+            closelog();
+            exit(1);
+        }
+        udp_gro_ = enable_udp_gro(fd_udp_socket);
+
+        /* And one receiving socket per multicast group */
+        for (i = 0; i < nmcast_groups_; i++) {
+            if ((mcast_groups_[i].socket == -1) &&
+                ((mcast_groups_[i].socket = setup_udp_socket(mcast_groups_[i].addr,
+                                                             mcast_groups_[i].port)) == -1)) {
+                closelog();
+                exit(1);
+            }
+            if (!setup_mcast_group(&(mcast_groups_[i]))) {
+                closelog();
+                exit(1);
+            }
+        }
+
+        if ((xsk_mode_ != XSK_MODE_OFF) && !xsk_setup(fd_udp_socket)) {
+            closelog();
+            exit(1);
+        }
+        if (tc_mode_ && (!handover_keepalive(fd_handover_conn) ||
+                         !tc_setup(fd_udp_socket))) {
+            closelog();
+            exit(1);
+        }
+    }
+
+    if (capture_path_ && (!handover_keepalive(fd_handover_conn) ||
+                          !capture_open())) {
+        closelog();
+        exit(1);
+    }
+
+    printf("Largest MTU: %d\n", largest_mtu_);
+
+    /* Create the buffer that will hold the packet content */
+    largest_mtu_ += 32; /* add some extra room just in case */
+    /* Add room for the IP and UDP headers */
+    largest_mtu_ += sizeof(struct iphdr) + sizeof(struct udphdr);
+    if (trunk_if_name_) {
+        /* Add room for the Ethernet header and the 802.1Q tag */
+        largest_mtu_ += ETH_HLEN + VLAN_HLEN;
+    }
+    /* Each queued datagram gets a slot of that size too */
+    queue_slot_len_ = largest_mtu_;
+    if (!trunk_if_name_ && (largest_mtu_ < UDP_RCV_BUF_LEN)) {
+        /* Datagrams reassembled from fragments, or coalesced by GRO, can be
+           much larger than the MTU; they are fragmented again on egress */
+        largest_mtu_ = UDP_RCV_BUF_LEN;
+    }
+
+    /* Trunk mode relays frames in place, in a single buffer. Otherwise, a
+       queue slot is needed for each queued packet in the worst case, when
+       all the receive buffers are held by other queued datagrams */
+    for (i = 0; i < SCHED_CLASSES; i++) {
+        queue_slots += MAXIFS * queue_depths_[i];
+    }
+    if (!handover_keepalive(fd_handover_conn) ||
+        !(trunk_if_name_ ? pools_init(largest_mtu_, 1, 0, 0) :
+          pools_init(largest_mtu_, POOL_RX_BUFS, queue_slot_len_, queue_slots))) {
+        for (i = 0; i < MAXIFS; i++) {
+            close(ifs_[i].raw_socket);
+        }
+	closelog();
+        exit(1);
+    }
+
+    if (!trunk_if_name_ && !sched_init()) {
+        closelog();
+        exit(1);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigusr1;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, 0); /* no SA_RESTART, to interrupt recvmsg() */
+
+    /* Fork to background */
+
+    if (fork_ && fork()) {
+	exit(0);
+    }
+    fclose(stdin);
+    fclose(stdout);
+    fclose(stderr);
+    forked_ = 1;
+
+    /* Let the old relay (if any) go, and wait for our own successor */
+    if (handover_path_) {
+        if ((fd_handover_conn != -1) && !handover_complete(fd_handover_conn)) {
+            /* The old relay is still forwarding, on the same sockets */
+            if (trunk_if_name_) {
+                close(fd_trunk_socket);
+            } else {
+                close(fd_udp_socket);
+                for (i = 0; i < MAXIFS; i++) {
+                    close(ifs_[i].raw_socket);
+                }
+                for (i = 0; i < nmcast_groups_; i++) {
+                    close(mcast_groups_[i].socket);
+                }
+            }
+            closelog();
+            exit(1);
+        }
+        fd_handover_listen = handover_listen();
+    }
+
+    rx_slot = pool_get(&(pools_.rx));
+    buf = pool_slot(&(pools_.rx), (unsigned int) rx_slot);
+    if (trunk_if_name_) {
+        trunk_loop(buf, fd_trunk_socket, fd_handover_listen);
+    }
+
+    for (;;) /* endless loop */
+    {
+        struct sockaddr_in rcv_addr;
+        struct msghdr rcv_msg;
+        struct iovec iov;
+        struct in_pktinfo rcv_pkt_info;
+        struct sockaddr_in rcv_dst_addr;
+	unsigned long rcv_pkt_ttl;
+        int rcv_gso_size;
+        int group;
+        struct Iface *txiface, *rxiface;
+        struct cmsghdr *cmsg;
+        struct iphdr *ip;
+        struct udphdr *udp;
+        struct PktHdr rcv_hdr; /* for the capture */
+        struct PktHdr snd_hdr;
+        unsigned char rcv_tos;
+        unsigned int cls;
+        int queued;
+        unsigned char *payload;
+        size_t seg_len, len, remaining, frag_len;
+
+        ssize_t rcv_msg_len;
+        u_char pkt_infos[CMSG_SPACE(sizeof(struct in_pktinfo)) +
+			 CMSG_SPACE(4) +
+			 CMSG_SPACE(1) +
+			 CMSG_SPACE(sizeof(struct sockaddr_in)) +
+			 CMSG_SPACE(sizeof(int))];
+
+        if (dump_stats_) {
+            dump_stats_ = 0;
+            dump_stats();
+        }
+
+        if (xsk_.nsocks) {
+            xsk_busy = xsk_process();
+        }
+
+        /* Give the queued datagrams a chance every so often while busy */
+        if (burst >= SCHED_RX_BURST) {
+            burst = 0;
+            sched_transmit_all();
+        }
+
+        /* The received UDP datagram (or several, coalesced by GRO) goes into
+           `buf`; the headers are built separately for each datagram sent.
+           Take a fresh receive buffer if datagrams queued from the last one
+           still refer to it */
+        if (pools_.rx.refs[rx_slot] > 1) {
+            pool_put(&(pools_.rx), (unsigned int) rx_slot);
+            rx_slot = pool_get(&(pools_.rx));
+            buf = pool_slot(&(pools_.rx), (unsigned int) rx_slot);
+        }
+        iov.iov_base = buf;
+        iov.iov_len = largest_mtu_;
+
+        rcv_msg.msg_name = &rcv_addr;
+        rcv_msg.msg_namelen = sizeof(rcv_addr);
+        rcv_msg.msg_iov = &iov;
+        rcv_msg.msg_iovlen = 1;
+        rcv_msg.msg_control = pkt_infos;
+        rcv_msg.msg_controllen = sizeof(pkt_infos);
+
+        rcv_msg_len = relay_recvmsg(fd_udp_socket, &rcv_msg, fd_handover_listen,
+                                    (sched_queued_ == 0) && (xsk_.nsocks == 0),
+                                    &group);
+        if ((rcv_msg_len < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            /* Nothing more to read for now: transmit, and if an interface
+               pushes back, try again shortly unless more packets arrive (on
+               the UDP socket or the AF_XDP sockets, if any) */
+            burst = 0;
+            sched_transmit_all();
+            if (xsk_.nsocks) {
+                /* Reap the completions that came in meanwhile first */
+                xsk_busy = xsk_process();
+            }
+            if (xsk_busy) {
+                continue;
+            }
+            if (sched_queued_ || xsk_.nsocks) {
+                handover_poll(fd_handover_listen, fd_udp_socket,
+                              (sched_queued_ || xsk_.waiting) ? SCHED_RETRY_MS : -1);
+            }
+            continue;
+        }
+        if (rcv_msg_len <= 0) {
+            DPRINT("recvmsg() returned %d, ignoring this packet\n", (int) rcv_msg_len);
+            continue;    /* ignore broken packets */
         }
 
         ipstr[INET_ADDRSTRLEN] = '\0';
         DPRINT("Received %ld bytes of data from %s:%u\n", rcv_msg_len,
                inet_ntop(AF_INET, &(rcv_addr.sin_addr), ipstr, INET_ADDRSTRLEN),
                (unsigned int) ntohs(rcv_addr.sin_port));
+        if (group >= 0) {
+            DPRINT("Sent to multicast group %s port %u\n",
+                   inet_ntop(AF_INET, &(mcast_groups_[group].addr), ipstr,
+                             INET_ADDRSTRLEN), (unsigned) mcast_groups_[group].port);
+        }
 
         /* We cannot proceed without the ancillary data */
         if (rcv_msg.msg_controllen == 0) {
             DPRINT("rcv_msg.msg_controllen == 0\n");
+            USDT(drop, 0, rcv_addr.sin_addr.s_addr, 0, rcv_msg_len,
+                 USDT_DROP_NO_CMSG, 0);
             continue;
         }
 
         memset(&rcv_pkt_info, 0, sizeof(rcv_pkt_info));
         memset(&rcv_dst_addr, 0, sizeof(rcv_dst_addr));
+        rcv_gso_size = 0;
+        rcv_tos = 0;
+        rcv_pkt_ttl = 0;
 
         for (cmsg = CMSG_FIRSTHDR(&rcv_msg); cmsg;
              cmsg = CMSG_NXTHDR(&rcv_msg, cmsg)) {
+            if ((cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO)) {
+                memcpy(&rcv_gso_size, CMSG_DATA(cmsg), sizeof(rcv_gso_size));
+                DPRINT("UDP_GRO segment size is %d\n", rcv_gso_size);
+                continue;
+            }
             if (cmsg->cmsg_level != IPPROTO_IP) {
                 DPRINT("In ancillary data, unsupported level %u\n",
                        (unsigned) cmsg->cmsg_level);
@@ -831,10 +4508,15 @@ int main(int argc,char **argv) {
                 DPRINT("IP_TTL present in ancillary data\n");
 		memcpy(&rcv_pkt_ttl, CMSG_DATA(cmsg), 4);
 		DPRINT("IP_TTL value is %lu\n", rcv_pkt_ttl);
+            } else if (cmsg->cmsg_type == IP_TOS) {
+                rcv_tos = *(unsigned char *) CMSG_DATA(cmsg);
+                DPRINT("IP_TOS value is %u\n", (unsigned) rcv_tos);
             } else {
                 DPRINT("Unasked cmsg type %u encountered\n", cmsg->cmsg_type);
             }
         }
+        USDT(receive, rcv_pkt_info.ipi_ifindex, rcv_addr.sin_addr.s_addr,
+             rcv_dst_addr.sin_addr.s_addr, rcv_pkt_ttl, rcv_msg_len);
 
         txiface = 0;
 	rxiface = 0;
@@ -852,6 +4534,8 @@ int main(int argc,char **argv) {
                 strcpy(ifname, "<???>");
             }
             DPRINT("Packet arrived on uninteresting network interface %s\n", ifname);
+            USDT(drop, rcv_pkt_info.ipi_ifindex, rcv_addr.sin_addr.s_addr,
+                 rcv_pkt_ttl, rcv_msg_len, USDT_DROP_IFACE, 0);
             continue;
         }
 
@@ -862,27 +4546,78 @@ int main(int argc,char **argv) {
 	   tx interface. If the srcaddrtype on the rx interface is SRCA_UNCHANGED, we
 	   cannot rely on the source address on the packet, so we have to rely on
 	   the "magic" echo marker TTL that we set on all transmitted packets. */
+        if (capture_.map) {
+            /* Reconstruct the headers of the received datagram */
+            memset(&rcv_hdr, 0, sizeof(rcv_hdr));
+            rcv_hdr.ip.version = 4;
+            rcv_hdr.ip.ihl = 5;
+            rcv_hdr.ip.tos = rcv_tos;
+            rcv_hdr.ip.ttl = (unsigned char) rcv_pkt_ttl;
+            rcv_hdr.ip.protocol = 17;
+            rcv_hdr.ip.saddr = rcv_addr.sin_addr.s_addr;
+            rcv_hdr.ip.daddr = rcv_dst_addr.sin_addr.s_addr;
+            rcv_hdr.udp.source = rcv_addr.sin_port;
+            rcv_hdr.udp.dest = htons((group < 0) ? udport_ : mcast_groups_[group].port);
+        }
+
 	if (rxiface->srcaddrtype == SRCA_UNCHANGED) {
 	    if ((unsigned char) rcv_pkt_ttl == echo_marker_ttl_) {
 		DPRINT("Echo (TTL matches echo marker): not forwarding\n");
+                USDT(drop, rxiface->ifindex, rcv_addr.sin_addr.s_addr, rcv_pkt_ttl,
+                     rcv_msg_len, USDT_DROP_ECHO_TTL, 0);
+                if (capture_.map) {
+                    capture_received(rxiface, &rcv_hdr, buf, rcv_msg_len, rcv_gso_size,
+                                     "echo (TTL matches echo marker) dropped");
+                }
 		continue;
 	    }
 	} else if (rcv_addr.sin_addr.s_addr == rxiface->srcaddr.s_addr) {
 	    DPRINT("Echo (Source IP address is ours): not forwarding\n");
 	    DPRINT("(ttl is %lu)\n", rcv_pkt_ttl);
+            USDT(drop, rxiface->ifindex, rcv_addr.sin_addr.s_addr, rcv_pkt_ttl,
+                 rcv_msg_len, USDT_DROP_ECHO_SADDR, 0);
+            if (capture_.map) {
+                capture_received(rxiface, &rcv_hdr, buf, rcv_msg_len, rcv_gso_size,
+                                 "echo (source address is ours) dropped");
+            }
 	    continue;
 	}
 
+        /* The buffer holds the largest possible datagram, but check anyway */
+        if (rcv_msg.msg_flags & MSG_TRUNC) {
+            DPRINT("Datagram truncated, not forwarding\n");
+            USDT(drop, rxiface->ifindex, rcv_addr.sin_addr.s_addr, rcv_pkt_ttl,
+                 rcv_msg_len, USDT_DROP_TRUNCATED, 0);
+            rxiface->truncated++;
+            if (capture_.map) {
+                capture_received(rxiface, &rcv_hdr, buf, rcv_msg_len, rcv_gso_size,
+                                 "truncated, dropped");
+            }
+            continue;
+        }
+
 	DPRINT("Forwarding\n");
 
-        /* Manufacture the IP header. `ip` is pointing to the beginning of buf */
+        cls = sched_classify(ntohs(rcv_addr.sin_port), rcv_tos);
+        DPRINT("Traffic class %u\n", cls);
+        USDT(classify, rxiface->ifindex, txiface->ifindex, cls, group);
+
+        /* Manufacture the IP header */
+        ip = &(snd_hdr.ip);
         ip->version = 4;
         ip->ihl = 5;
-        ip->tos = 0;
+        ip->tos = relay_tos(rcv_tos);
         ip->tot_len = 0; /* Kernel will fill this */
         ip->id = 0;  /* Kernel will fill this */
         ip->frag_off = 0;
-        ip->ttl = (echo_marker_ttl_ == 0) ? 64 : (unsigned char) echo_marker_ttl_;
+        if (echo_marker_ttl_ != 0) {
+            ip->ttl = (unsigned char) echo_marker_ttl_;
+        } else if (group >= 0) {
+            /* Keep the TTL of multicast, e.g. 255 for mDNS */
+            ip->ttl = (unsigned char) rcv_pkt_ttl;
+        } else {
+            ip->ttl = 64;
+        }
         ip->protocol = 17;
         ip->check = 0; /* Kernel will fill this */
         if (txiface->srcaddrtype == SRCA_UNCHANGED) {
@@ -890,25 +4625,78 @@ int main(int argc,char **argv) {
         } else {
             ip->saddr = txiface->srcaddr.s_addr;
         }
-        ip->daddr = txiface->dstaddr.s_addr;
+        /* Multicast is relayed to the same group */
+        ip->daddr = (group < 0) ? txiface->dstaddr.s_addr : mcast_groups_[group].addr.s_addr;
+        USDT(build, txiface->ifindex, ip->saddr, ip->daddr, ip->ttl, ip->tos);
 
-        /* Manufacture the UDP header.
-           `udp` is pointing to the offset in `buf` after the IP header */
-        udp->source = rcv_addr.sin_port;
-        udp->dest = htons(udport_);
-        udp->len = htons((unsigned short) (rcv_msg_len + sizeof(*udp)));
-        udp->check = 0;
+        /* Split a GRO-coalesced buffer back into datagrams of `rcv_gso_size`
+           bytes (the last one may be shorter); otherwise there is just one */
+        seg_len = ((rcv_gso_size > 0) && (rcv_gso_size < rcv_msg_len)) ?
+            (size_t) rcv_gso_size : (size_t) rcv_msg_len;
+        payload = buf;
+        remaining = rcv_msg_len;
 
-        /* Compute and fill in the UDP checksum */
-        udp->check = htons(udp_csum(ip, udp, iov.iov_base, rcv_msg_len));
+        while (remaining > 0) {
+            len = (remaining < seg_len) ? remaining : seg_len;
 
-        snd_addr.sin_family = AF_INET;
-        snd_addr.sin_port = htons(udport_);
-        snd_addr.sin_addr.s_addr = ip->daddr;
+            /* Manufacture the UDP header */
+            udp = &(snd_hdr.udp);
+            udp->source = rcv_addr.sin_port;
+            udp->dest = htons((group < 0) ? udport_ : mcast_groups_[group].port);
+            udp->len = htons((unsigned short) (len + sizeof(*udp)));
+            udp->check = 0;
 
-        if (sendto(txiface->raw_socket, buf, rcv_msg_len + sizeof(*ip) + sizeof(*udp),
-                   0, (struct sockaddr *) &snd_addr, sizeof(snd_addr)) < 0) {
-            EPRINT("Failed to transmit: %s\n", strerror(errno));
+            /* Compute and fill in the UDP checksum */
+            udp->check = htons(udp_csum(ip, udp, payload, len));
+            USDT(checksum, txiface->ifindex, ntohs(udp->check), len);
+
+            /* Make room by transmitting first if the queue cannot take the
+               datagram (all of its fragments), so that datagrams are only
+               dropped when the interface can't keep up */
+            if (txiface->queues[cls].count +
+                sched_nfrags(txiface, cls, len, &frag_len) >
+                txiface->queues[cls].depth) {
+                sched_transmit(txiface);
+            }
+
+            /* Queue the datagram in place, unless the receive buffer is the
+               last free one, as the next datagram needs one */
+            if (pools_.rx.nfree) {
+                queued = sched_enqueue(txiface, cls, &snd_hdr, payload, len, rx_slot);
+            } else {
+                pools_.rx.exhausted++;
+                queued = sched_enqueue(txiface, cls, &snd_hdr, payload, len, -1);
+            }
+            if (queued == 0) {
+                DPRINT("Class %u queue full, not forwarding\n", cls);
+                USDT(drop, txiface->ifindex, rcv_addr.sin_addr.s_addr, rcv_pkt_ttl,
+                     len, USDT_DROP_QUEUE_FULL, 0);
+            } else if (queued == -1) {
+                DPRINT("Datagram of %zu bytes is too large, not forwarding\n", len);
+                USDT(drop, txiface->ifindex, rcv_addr.sin_addr.s_addr, rcv_pkt_ttl,
+                     len, USDT_DROP_TOO_BIG, 0);
+            } else if (queued < 0) {
+                DPRINT("No free queue slot, not forwarding\n");
+                USDT(drop, txiface->ifindex, rcv_addr.sin_addr.s_addr, rcv_pkt_ttl,
+                     len, USDT_DROP_NO_SLOT, 0);
+            }
+            if (capture_.map) {
+                if (queued > 0) {
+                    snprintf(comment, sizeof(comment), "forwarded (class %u)", cls);
+                } else if (queued == 0) {
+                    snprintf(comment, sizeof(comment), "class %u queue full, dropped",
+                             cls);
+                } else if (queued == -1) {
+                    strcpy(comment, "too large, dropped");
+                } else {
+                    strcpy(comment, "no free queue slot, dropped");
+                }
+                capture_received(rxiface, &rcv_hdr, payload, len, 0, comment);
+            }
+
+            payload += len;
+            remaining -= len;
+            burst++;
         }
     }
 }